@@ -46,17 +46,14 @@ void bg()
     w = termWidth / 2;
     h = termHeight - 2;
     //clearScreen(fromRGB(0x1c, 0x1c, 0x1c));
-    clearScreen();
-    srand(69);
-    for (int x = 0; x < terminalSize().first; x++)
-    {
-        for (int y = 0; y < terminalSize().second; y++)
-        {
-            if (randomInt(0, 10) == 0)
-                write(x, y, '.', COLOR_WHITE_256, COLOR_CLEAR_256);
-        }
-    }
-    srand(time(0));
+    // Stelle fisse: una su 11 celle, scelta con un hash della posizione
+    shade([](int x, int y)
+          {
+              unsigned hash = (unsigned)x * 73856093u ^ (unsigned)y * 19349663u;
+              hash = (hash ^ (hash >> 13)) * 0x5bd1e995u;
+              bool star = (hash ^ (hash >> 15)) % 11 == 0;
+              return pwetty::Cell{star ? U'.' : U' ', star ? COLOR_WHITE_256 : DEFAULT_FG, DEFAULT_BG};
+          });
 }
 
 void spawnParticles(int o, int b)
@@ -66,25 +63,26 @@ void spawnParticles(int o, int b)
     borCols.push_back(COLOR_WHITE_256);
     borCols.push_back(COLOR_YELLOW_256);
     
+    pwetty::Rng &rng = pwetty::rng();
     for (int i = 0; i < o; ++i)
     {
         orbiting.push_back(Particle{
-            orbCols[rand() % orbCols.size()],
-            (float)pow(randomFloat(), 2),
-            randomInt(0, 360),
-            (char)randomInt(33, 127),
-            (char)randomInt(33, 127),
+            orbCols[rng.nextInt(0, (int)orbCols.size() - 1)],
+            (float)pow(rng.nextFloat(), 2),
+            rng.nextInt(0, 360),
+            (char)rng.nextInt(33, 127),
+            (char)rng.nextInt(33, 127),
         });
     }
     
     for (int i = 0; i < b; ++i)
     {
         borderParticles.push_back(Particle{
-            borCols[rand() % borCols.size()],
-            (1.f - (float)pow(randomFloat(), 12) / 1.5f),
-            randomInt(0, 360),
-            (char)randomInt(33, 127),
-            (char)randomInt(33, 127),
+            borCols[rng.nextInt(0, (int)borCols.size() - 1)],
+            (1.f - (float)pow(rng.nextFloat(), 12) / 1.5f),
+            rng.nextInt(0, 360),
+            (char)rng.nextInt(33, 127),
+            (char)rng.nextInt(33, 127),
         });
     }
 }
@@ -97,16 +95,15 @@ void blackHole()
     
     float sen = (1 + sin(timeVal) / 15.f);
     
-    for (int i = 0; i < w; i++)
-    {
-        for (int j = 0; j < h; j++)
-        {
-            if (distanceInt(i, j, cx, cy) <= r * sen)
-            {
-                writePixel(i, j, COLOR_BLACK_256, COLOR_BLACK_256, '#', '#');
-            }
-        }
-    }
+    float radius = r * sen;
+    setPixelMode(true);
+    shade(cx - (int)radius - 1, cy - (int)radius - 1, cx + (int)radius + 1, cy + (int)radius + 1, [=](int i, int j)
+          {
+              if (distanceInt(i, j, cx, cy) <= radius)
+                  return pwetty::Cell{U'#', COLOR_BLACK_256, COLOR_BLACK_256};
+              return pwetty::Cell{0, CLEAR, CLEAR};
+          });
+    setPixelMode(false);
     
     for (int i = 0; i < borderParticles.size(); i += max(1, 236 / w))
     {
@@ -144,7 +141,6 @@ void drawParticles(bool inFront)
 
 int main()
 {
-    srand(time(0));
     spawnParticles(1000, 1000);
     
     while (true)
@@ -3,9 +3,9 @@
 #include <sstream>
 #include <iomanip>
 
-#include "pwetty.h"
 #define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#define PWETTY_STB_IMAGE
+#include "pwetty.h"
 
 using namespace std;
 
@@ -15,16 +15,12 @@ using namespace std;
 #define CY (TH / 2)
 #define FRAMES 6572
 #define TARGET_FPS 30
-#define FRAME_TIME (1000.0 / TARGET_FPS)
 
 enum Style{
-    PIXEL, BLACKWHITE, ASCII, STYLES
+    PIXEL, BLACKWHITE, ASCII, GRAPHICS, STYLES
 };
 
-typedef vector<vector<Color>> frame;
-vector<frame> video;
-double lastFrameTime = 0;
-double lastTime = 0;
+vector<const pwetty::Image *> video;
 Style style = PIXEL;
 
 Color compareToBlackWhite(const Color& color) {
@@ -34,102 +30,88 @@ Color compareToBlackWhite(const Color& color) {
     return (distToBlack < distToWhite) ? BLACK : WHITE;
 }
 
-void limitFPS() {
-    double currentTime = getTime();
-    double frameTime = (currentTime - lastFrameTime) * 1000.0; // Converti in millisecondi
-    double sleepTime = FRAME_TIME - frameTime;
-    
-    if (sleepTime > 0) {
-        sleepMs((int)sleepTime);
-    }
-    
-    lastFrameTime = getTime();
-}
-
 string intToStringWithPadding(int number, int width = 4) {
     ostringstream oss;
     oss << setw(width) << setfill('0') << number;
     return oss.str();
 }
 
-frame loadImagePixels(string filename, int &width, int &height)
-{
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, nullptr, 4);
-    frame matrix(height, vector<Color>(width));
+// Un frame del video per ogni passo a 30 fps: se il disegno resta indietro il passo
+// fisso salta i frame persi invece di rallentare il video
+class Player : public pwetty::App {
+public:
+    Player() {
+        setUpdateRate(TARGET_FPS);
+        setAnimating(true);
+        // Su un collegamento lento (ssh) meglio meno colori che frame in ritardo
+        setAdaptiveQuality(true, TARGET_FPS);
+    }
 
-    if (!data)
-    {
-        cerr << "Error while loading the image\n";
-        return {};
+    void onEvent(const pwetty::Event &e) override {
+        if (e.type != pwetty::EventType::KeyPress) return;
+        if (e.key == KEY_SPACE || e.key == ' ' || e.key == 's') {
+            style = (Style)((int)style + 1);
+            style = (Style)((int)style%(int)STYLES);
+        }
+    }
+
+    void onUpdate(double) override {
+        frame++;
+        frame%=FRAMES;
     }
 
-    for (int y = 0; y < height; y++)
-        for (int x = 0; x < width; x++)
-        {
-            int i = (y * width + x) * 4;
-            matrix[y][x] = {data[i], data[i + 1], data[i + 2]}; // DISCARD ALPHA data[i + 3]
+    void onDraw() override {
+        if (style == PIXEL) {
+            pwetty::drawImage(*video[frame]);
+            return;
+        }
+        if (style == GRAPHICS) {
+            // Sixel o kitty se il terminale li supporta e se costano meno delle celle
+            pwetty::drawImageGraphics(*video[frame]);
+            return;
         }
+        // L'immagine gia' ridotta alla dimensione del terminale
+        const pwetty::ImageLevel &image = video[frame]->fit(TW, TH);
+        switch(style){
+            case BLACKWHITE:
+                shade([&](int x, int y) {
+                    return pwetty::Cell{U' ', DEFAULT_FG, compareToBlackWhite(image.at(x, y))};
+                });
+                break;
+            case ASCII:
+                shade([&](int x, int y) {
+                    return pwetty::Cell{compareToBlackWhite(image.at(x, y)) == BLACK ? U'.' : U'#', DEFAULT_FG, DEFAULT_BG};
+                });
+                break;
+            default:
+                break;
+        }
+    }
 
-    stbi_image_free(data);
-    return matrix;
-}
+private:
+    int frame = 0;
+};
 
 int main()
 {
-    int width, height;
-    
     // Carica l'immagine
     showCursor(false);
     for(int i=0; i<FRAMES; i++){
         string filename = "frames/output_" + intToStringWithPadding(i+1) + ".jpg";
-        frame image = loadImagePixels(filename, width, height);
-        video.push_back(image);
+        const pwetty::Image &image = pwetty::loadImage(filename);
+        if (image.empty())
+            cerr << "Error while loading the image\n";
+        video.push_back(&image);
 
         clearScreen();
-        writeAligned(Alignment::Center, TH/2, "Loading: " + to_string((int)((float)i/(float)FRAMES*100.f)) + "%");
+        writeAlignedf(Alignment::Center, TH/2, "Loading: {}%", (int)((float)i/(float)FRAMES*100.f));
         render();
     }
 
-    int frame = 0;
-    lastTime = getTime();
-    lastFrameTime = getTime();
-    while (true)
-    {
-        clearScreen();
-        frame++;
-        frame%=FRAMES;
-
-        updateInput();
-        char c = getKey();
-        if(keyPressed() && (c == KEY_SPACE || c == 's')){
-            style = (Style)((int)style + 1);
-            style = (Style)((int)style%(int)STYLES);
-        }
-
-        for (int y = 0; y < TH; y++)
-        {
-            for (int x = 0; x < TW; x++)
-            {
-                int image_x = ((float)x * (float)width)/(float)TW;
-                int image_y = ((float)y * (float)height)/(float)TH;
-                switch(style){
-                    case PIXEL:
-                        write(x, y, ' ', DEFAULT_FG, video[frame][image_y][image_x]);
-                        break;
-                    case BLACKWHITE:
-                        write(x, y, ' ', DEFAULT_FG, compareToBlackWhite(video[frame][image_y][image_x]));
-                        break;
-                    case ASCII:
-                        char c = compareToBlackWhite(video[frame][image_y][image_x])==BLACK?'.':'#';
-                        write(x, y, c);
-                        break;
-                }
-            }
-        }
-
-        render();
-        limitFPS();
-    }
+    Player player;
+    player.run();
 
+    clearScreen();
+    showCursor(true);
     return 0;
 }
@@ -80,8 +80,8 @@ void generateField(){
 	int mines = MINES;
 
 	while(mines>0){
-		int randX = rand()%SIZE;
-		int randY = rand()%SIZE;
+		int randX = pwetty::rng().nextInt(0, SIZE-1);
+		int randY = pwetty::rng().nextInt(0, SIZE-1);
 		
 		// Controlla di non essere nel 3x3 intorno al cursore
    		if(!(abs(cursorX - randX) <= 1 && abs(cursorY - randY) <= 1)){
@@ -199,109 +199,103 @@ void draw()
     write(cursorX*4 + (CX-SIZE*2) + 3, cursorY*2 + (CY-SIZE) + 1, ']');
 }
 
-int main()
-{
-    reset();
-    frame = 0;
+// Il gioco e' fermo finche' non arriva un tasto: l'animazione (per il timer) resta
+// attiva solo mentre si gioca, e a 4 aggiornamenti al secondo
+class Minesweeper : public pwetty::App {
+public:
+	Minesweeper() { setUpdateRate(4); }
 
-    showCursor(false);
-
-    while (1)
-    {
-        clearScreen();
-
-        if(TW < (SIZE * 2 + 3) || TH < (SIZE * 2 + 6)){
-       		writeAligned(Alignment::Center, CY, "TERMINAL IS TOO SMALL", RED);
-       		render();
-	        sleepMs(16); // 60 fps
-	        frame++;
-       		continue;
-       	}
+	void onEvent(const pwetty::Event &e) override {
+		if (e.type != pwetty::EventType::KeyPress) return;
+		int c = e.key;
 
 		if(!lost && !win){
-	        if (keyPressed())
-	        {
-	            int c = getKey();
-	            switch (c)
-	            {
-	            case 'c':
-	            case 'q':
-	            	clearScreen();
-				    showCursor(true);
-				    return 0;
-	            case 'w':
-	            case KEY_UP: 
-	            	cursorY--;
-	            	break;
-	            case 'a':
-	            case KEY_LEFT:
-	            	cursorX--;
-	            	break;
-	            case 's':
-	            case KEY_DOWN:
-	            	cursorY++;
-	            	break;
-	            case 'd':
-	            case KEY_RIGHT:
-	            	cursorX++;
-	            	break;
-	            case 'f':
-	            	flag();
-	            	break;
-	            case ' ':
-	            case KEY_SPACE:
-	            case 'e':
-	            case KEY_ENTER:
-	            	dig();
-	            	break;
-	            }
-	        }
+			switch (c)
+			{
+			case 'c':
+			case 'q':
+				quit();
+				return;
+			case 'w':
+			case KEY_UP: 
+				cursorY--;
+				break;
+			case 'a':
+			case KEY_LEFT:
+				cursorX--;
+				break;
+			case 's':
+			case KEY_DOWN:
+				cursorY++;
+				break;
+			case 'd':
+			case KEY_RIGHT:
+				cursorX++;
+				break;
+			case 'f':
+				flag();
+				break;
+			case ' ':
+			case KEY_SPACE:
+			case 'e':
+			case KEY_ENTER:
+				dig();
+				break;
+			}
+
+			cursorX = clampInt(cursorX, 0, SIZE-1);
+			cursorY = clampInt(cursorY, 0, SIZE-1);
+		} else if(c == ' ' || c == KEY_SPACE){
+			reset();
+		}
 
-	        cursorX = clampInt(cursorX, 0, SIZE-1);
-	        cursorY = clampInt(cursorY, 0, SIZE-1);
-	    } else {
-	    	if (keyPressed()){
-	    		int c = getKey();
-	            switch (c)
-	            {
-	            	case ' ':
-	            	case KEY_SPACE:
-						reset();
-						break;
-				}
-	    	}
-	    }
+		win = checkWin();
+		setAnimating(!lost && !win);
+	}
 
-        // setMouseInputEnabled(true);
-        updateInput();
+	void onUpdate(double) override {
+		game_time = getTime() - start_time;
+		frame++;
+	}
 
-        win = checkWin();
+	void onDraw() override {
+		if(TW < (SIZE * 2 + 3) || TH < (SIZE * 2 + 6)){
+			writeAligned(Alignment::Center, CY, "TERMINAL IS TOO SMALL", RED);
+			return;
+		}
 
-       	draw();
-       	if(lost){
+		draw();
+		if(lost){
 			writeAligned(Alignment::Center, (CY-SIZE) - 2, "Game Over!", RED);
 			writeAligned(Alignment::Center, (CY-SIZE) - 1, "Press [SPACE] to restart", GRAY);
-       	} else if(win){
-       		writeAligned(Alignment::Center, (CY-SIZE) - 2, "You Won!", LIME);
-       		writeAligned(Alignment::Center, (CY-SIZE) - 1, "Press [SPACE] to restart", GRAY);
-       	} else {
-       		game_time = getTime() - start_time;
-       	}
-
-       	writeAligned(Alignment::Center, (CY-SIZE) + (SIZE*2) + 2, to_string((int)(game_time)) + "s", WHITE);
-
-        if (getTime() - start_time < 10)
-        {
-            int i = 0;
-            write(1, i++, "[SPACE] Dig", YELLOW);
-            write(1, i++, "[F] Flag", YELLOW);
-            write(1, i++, "[Q] Quit", YELLOW);
-        }
-
-        render();
-        sleepMs(16); // 60 fps
-        frame++;
-    }
+		} else if(win){
+			writeAligned(Alignment::Center, (CY-SIZE) - 2, "You Won!", LIME);
+			writeAligned(Alignment::Center, (CY-SIZE) - 1, "Press [SPACE] to restart", GRAY);
+		}
+
+		writeAlignedf(Alignment::Center, (CY-SIZE) + (SIZE*2) + 2, WHITE, DEFAULT_BG, "{}s", (int)game_time);
+
+		if (getTime() - start_time < 10)
+		{
+			int i = 0;
+			write(1, i++, "[SPACE] Dig", YELLOW);
+			write(1, i++, "[F] Flag", YELLOW);
+			write(1, i++, "[Q] Quit", YELLOW);
+		}
+	}
+};
+
+int main()
+{
+    reset();
+    frame = 0;
+    game_time = 0;
+
+    showCursor(false);
+
+    Minesweeper game;
+    game.setAnimating(true);
+    game.run();
 
     clearScreen();
     showCursor(true);
@@ -11,15 +11,24 @@
     #include <unistd.h>
     #include <fcntl.h>
     #include <sys/select.h>
+    #include <poll.h>
     #include <sys/ioctl.h>
     #include <time.h>
     #include <errno.h>
+    #include <sys/stat.h>
+    #include <sys/uio.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <climits>
 #else
     #error "Operating system not supported by pwetty"
 #endif
 
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <type_traits>
 #include <vector>
 #include <queue>
 #include <thread>
@@ -30,11 +39,32 @@
 #include <functional>
 #include <algorithm>
 #include <csignal>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define PWETTY_SSE2
+    #include <emmintrin.h>
+#endif
 
 #define M_PI 3.14159265358979323846
 
 #include "uteels.h"
 
+// Con PWETTY_STB_IMAGE loadImage() decodifica con stb_image
+// (STB_IMAGE_IMPLEMENTATION va definito in un solo file, prima di includere pwetty.h)
+#ifdef PWETTY_STB_IMAGE
+    #include "stb_image.h"
+#endif
+
 using namespace std;
 
 // ======================== KEY ENUMS ========================
@@ -80,6 +110,17 @@ const Color CLEAR      = {-1, -1, -1};
 const Color DEFAULT_BG = {-2, -2, -2};
 const Color DEFAULT_FG = {-3, -3, -3};
 
+// I 16 colori base del tema del terminale (indici 0-15): non hanno un RGB fisso e i
+// modelli di colore li mandano come indice. Come DEFAULT_* e CLEAR sono negativi, quindi
+// non si mescolano.
+inline Color paletteColor(int index) {
+    int v = -16 - (index & 15);
+    return Color(v, v, v);
+}
+
+// L'indice 0-15 di un colore di paletteColor(), -1 per tutti gli altri
+inline int paletteIndex(const Color &c) { return (c.r <= -16 && c.r >= -31) ? -16 - c.r : -1; }
+
 double colorDistance(const Color& c1, const Color& c2) {
     return sqrt(pow(c1.r - c2.r, 2) + pow(c1.g - c2.g, 2) + pow(c1.b - c2.b, 2));
 }
@@ -94,269 +135,2029 @@ enum class Alignment {
 inline string rgbFg(const Color &c) {
     if (c == DEFAULT_FG)
         return "\033[39m";
+    if (int i = paletteIndex(c); i >= 0)
+        return "\033[" + to_string(i < 8 ? 30 + i : 82 + i) + "m";
     return "\033[38;2;" + to_string(c.r) + ";" + to_string(c.g) + ";" + to_string(c.b) + "m";
 }
 
 inline string rgbBg(const Color &c) {
     if (c == DEFAULT_BG)
         return "\033[49m";
+    if (int i = paletteIndex(c); i >= 0)
+        return "\033[" + to_string(i < 8 ? 40 + i : 92 + i) + "m";
     return "\033[48;2;" + to_string(c.r) + ";" + to_string(c.g) + ";" + to_string(c.b) + "m";
 }
 
 inline const string RESET_COLOR = "\033[0m";
 
-#ifdef OS_LINUX
 string charToUnicode(char c);
-#endif
 
-// ======================== CONSOLE SINGLETON ========================
+// ======================== PROFILER ========================
+// PWETTY_ZONE("nome") misura il blocco in cui si trova. Con PWETTY_PROFILE definito
+// prima di includere pwetty.h ogni thread scrive le sue zone in un buffer tutto suo
+// (senza lock) e writeProfileTrace() le salva nel formato trace-event di Chrome, da
+// aprire con chrome://tracing o ui.perfetto.dev. Senza PWETTY_PROFILE le zone spariscono.
+// Se PWETTY_TRACE=file.json e' nell'ambiente la traccia si salva anche all'uscita.
+#define PWETTY_CONCAT_(a, b) a##b
+#define PWETTY_CONCAT(a, b) PWETTY_CONCAT_(a, b)
+
+#ifdef PWETTY_PROFILE
 namespace detail {
-    class Console {
-    public:
-        // Dimensioni e buffer
-        int width, height;
-        vector<vector<char>> buffer, prevBuffer;
-        vector<vector<Color>> fgBuffer, bgBuffer, prevFgBuffer, prevBgBuffer;
-        bool pixelMode;
-        bool rawModeEnabled;
+    struct ProfileEvent {
+        const char *name;
+        int64_t startNs, durationNs;
+    };
 
-        // Input
-        queue<int> keyQueue;
-        int mouseX, mouseY;
-        bool mouseButtonDown[8];
-        bool mouseButtonPressed[8];
-        bool mouseButtonReleased[8];
+    // Ring di eventi di un thread: scrive solo il suo thread, quando e' pieno si
+    // sovrascrivono i piu' vecchi
+    struct ProfileThread {
+        static const size_t CAPACITY = 1 << 16;
+        vector<ProfileEvent> events = vector<ProfileEvent>(CAPACITY);
+        atomic<size_t> count{0};
+        int id = 0;
+    };
 
-        #ifdef OS_WINDOWS
-            HANDLE hConsole;
-            HANDLE hStdin;
-            DWORD fdwSaveOldMode;
-            bool prevMouseButtonState[8];
-        #endif
+    class Profiler {
+    public:
+        // Mai distrutto: zone nei distruttori statici (console, worker) restano valide
+        static Profiler &get() {
+            static Profiler *instance = new Profiler();
+            return *instance;
+        }
 
-        #ifdef OS_LINUX
-            struct termios orig_termios;
-            string incompleteSequence;
-        #endif
+        int64_t now() const {
+            return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+        }
 
-        Console() : mouseX(0), mouseY(0), pixelMode(false), rawModeEnabled(false) {
-            for(int i = 0; i < 8; i++) {
-                mouseButtonDown[i] = false;
-                mouseButtonPressed[i] = false;
-                mouseButtonReleased[i] = false;
-                #ifdef OS_WINDOWS
-                    prevMouseButtonState[i] = false;
-                #endif
+        // Il buffer del thread chiamante, registrato al primo uso (l'unico lock).
+        // I buffer restano al Profiler anche quando il thread finisce.
+        ProfileThread &thread() {
+            thread_local ProfileThread *current = nullptr;
+            if (!current) {
+                lock_guard<mutex> lock(m);
+                threads.push_back(make_unique<ProfileThread>());
+                current = threads.back().get();
+                current->id = (int)threads.size();
             }
-            
-            #ifdef OS_WINDOWS
-                hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-                hStdin = GetStdHandle(STD_INPUT_HANDLE);
-            #endif
-
-            setupSignalHandler();
-            enableRawMode();
-            initBuffersToCurrentSize();
+            return *current;
         }
 
-        ~Console() {
-            disableRawMode();
+        void record(const char *name, int64_t start, int64_t end) {
+            ProfileThread &t = thread();
+            size_t n = t.count.load(memory_order_relaxed);
+            t.events[n % ProfileThread::CAPACITY] = {name, start, end - start};
+            t.count.store(n + 1, memory_order_release);
         }
 
-        // ======================== SIGNAL HANDLERS ========================
-        #ifdef OS_WINDOWS
-            static BOOL WINAPI handle_ctrl_c(DWORD type) {
-                if (type == CTRL_C_EVENT) {
-                    Console::get().cleanup();
+        bool write(const string &path) {
+            FILE *file = fopen(path.c_str(), "w");
+            if (!file) return false;
+            fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            bool first = true;
+            lock_guard<mutex> lock(m);
+            for (const auto &t : threads) {
+                fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                              "\"args\":{\"name\":\"pwetty %d\"}}",
+                        first ? "" : ",\n", t->id, t->id);
+                first = false;
+                size_t count = t->count.load(memory_order_acquire);
+                size_t begin = count > ProfileThread::CAPACITY ? count - ProfileThread::CAPACITY : 0;
+                for (size_t i = begin; i < count; i++) {
+                    const ProfileEvent &e = t->events[i % ProfileThread::CAPACITY];
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                            e.name, t->id, e.startNs / 1000.0, e.durationNs / 1000.0);
                 }
-                return FALSE;
             }
+            fprintf(file, "\n]}\n");
+            fclose(file);
+            return true;
+        }
 
-            void setupSignalHandler() {
-                SetConsoleCtrlHandler(handle_ctrl_c, TRUE);
+        void clear() {
+            lock_guard<mutex> lock(m);
+            for (auto &t : threads) t->count.store(0, memory_order_relaxed);
+        }
+
+    private:
+        chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+        mutex m;
+        vector<unique_ptr<ProfileThread>> threads;
+
+        Profiler() {
+            atexit([] {
+                const char *path = getenv("PWETTY_TRACE");
+                if (path && *path) get().write(path);
+            });
+        }
+    };
+
+    class ProfileZone {
+    public:
+        explicit ProfileZone(const char *zoneName) : name(zoneName), start(Profiler::get().now()) {}
+        ~ProfileZone() { Profiler::get().record(name, start, Profiler::get().now()); }
+
+    private:
+        const char *name;
+        int64_t start;
+    };
+}
+
+#define PWETTY_ZONE(name) detail::ProfileZone PWETTY_CONCAT(pwettyZone, __LINE__)(name)
+
+// Salva le zone registrate finora come trace-event JSON
+inline bool writeProfileTrace(const string &path) { return detail::Profiler::get().write(path); }
+inline void clearProfile() { detail::Profiler::get().clear(); }
+#else
+#define PWETTY_ZONE(name) ((void)0)
+
+inline bool writeProfileTrace(const string &) { return false; }
+inline void clearProfile() {}
+#endif
+
+// ======================== RANDOM ========================
+namespace pwetty {
+    // xoshiro256++: veloce, 256 bit di stato, nessuno stato globale. jump() salta avanti
+    // di 2^128 numeri: flussi diversi dello stesso seme non si sovrappongono mai.
+    // Va bene anche come generatore per <random> e shuffle().
+    class Rng {
+    public:
+        using result_type = uint64_t;
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return UINT64_MAX; }
+
+        explicit Rng(uint64_t seed = 0x9e3779b97f4a7c15ull) { reseed(seed); }
+
+        // Lo stato viene da splitmix64: anche semi vicini (0, 1, 2...) danno stati lontani
+        void reseed(uint64_t seed) {
+            for (uint64_t &word : s) {
+                seed += 0x9e3779b97f4a7c15ull;
+                uint64_t z = seed;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                word = z ^ (z >> 31);
             }
-        #else
-            static void handle_sigint(int sig) {
-                (void)sig;
-                Console::get().cleanup();
-                exit(0);
+        }
+
+        uint64_t next() {
+            uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+            uint64_t t = s[1] << 17;
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = rotl(s[3], 45);
+            return result;
+        }
+        uint64_t operator()() { return next(); }
+
+        // Intero in [lo, hi] senza il bias di rand() % n (moltiplicazione di Lemire)
+        int nextInt(int lo, int hi) {
+            if (hi <= lo) return lo;
+            uint64_t range = (uint64_t)((int64_t)hi - lo) + 1;
+            if (range > UINT32_MAX) return (int)(uint32_t)(next() >> 32);
+            uint64_t product = (next() >> 32) * range;
+            if ((uint32_t)product < range) {
+                uint32_t threshold = (uint32_t)(-(uint32_t)range) % (uint32_t)range;
+                while ((uint32_t)product < threshold)
+                    product = (next() >> 32) * range;
             }
+            return (int)(lo + (int64_t)(product >> 32));
+        }
 
-            void setupSignalHandler() {
-                signal(SIGINT, handle_sigint);
-                signal(SIGTERM, handle_sigint);
+        // [0, 1): i bit alti, i migliori di xoshiro
+        float nextFloat() { return (next() >> 40) * 0x1p-24f; }
+        double nextDouble() { return (next() >> 11) * 0x1p-53; }
+        float nextFloat(float lo, float hi) { return lo + (hi - lo) * nextFloat(); }
+        bool chance(float p) { return nextFloat() < p; }
+
+        // n float in [lo, hi): due per ogni numero a 64 bit
+        void fillUniform(float *out, size_t n, float lo = 0.f, float hi = 1.f) {
+            float scale = (hi - lo) * 0x1p-24f;
+            // Stato in una copia locale: resta nei registri invece di tornare in memoria
+            Rng local = *this;
+            size_t i = 0;
+            for (; i + 2 <= n; i += 2) {
+                uint64_t r = local.next();
+                out[i] = lo + (float)(r >> 40) * scale;
+                out[i + 1] = lo + (float)((r >> 8) & 0xffffff) * scale;
             }
-        #endif
+            if (i < n) out[i] = lo + (float)(local.next() >> 40) * scale;
+            *this = local;
+        }
 
-        // ======================== RAW MODE ========================
-        void enableRawMode() {
-            if (rawModeEnabled) return;
+        void jump() { jumpWith(JUMP); }          // avanti di 2^128
+        void longJump() { jumpWith(LONG_JUMP); } // avanti di 2^192
 
-            #ifdef OS_LINUX
-                if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) {
-                    return;
-                }
-                
-                struct termios raw = orig_termios;
-                raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-                raw.c_iflag &= ~(IXON | ICRNL | BRKINT | INPCK | ISTRIP);
-                raw.c_oflag &= ~(OPOST);
-                raw.c_cflag |= CS8;
-                raw.c_cc[VMIN] = 0;  // Cambiato a 0 per lettura non bloccante
-                raw.c_cc[VTIME] = 1; // Timeout di 0.1 secondi
-                
-                if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-                    perror("tcsetattr");
-                    return;
+    private:
+        uint64_t s[4];
+
+        static constexpr uint64_t JUMP[4] = {
+            0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull, 0x39abdc4529b1661cull};
+        static constexpr uint64_t LONG_JUMP[4] = {
+            0x76e15d3efefdcbbfull, 0xc5004e441c522fb3ull, 0x77710069854ee241ull, 0x39109bb02acbe635ull};
+
+        static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+        void jumpWith(const uint64_t (&poly)[4]) {
+            uint64_t t[4] = {0, 0, 0, 0};
+            for (uint64_t word : poly) {
+                for (int b = 0; b < 64; b++) {
+                    if (word & (1ull << b))
+                        for (int k = 0; k < 4; k++) t[k] ^= s[k];
+                    next();
                 }
-                
-                // Mouse reporting
-                cout << "\033[?1000h\033[?1003h\033[?1006h" << flush;
-                fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-            #endif
+            }
+            for (int k = 0; k < 4; k++) s[k] = t[k];
+        }
+    };
+}
 
-            #ifdef OS_WINDOWS
-                GetConsoleMode(hStdin, &fdwSaveOldMode);
-                DWORD fdwMode = ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT;
-                SetConsoleMode(hStdin, fdwMode);
-            #endif
+namespace detail {
+    // Seme comune a tutti i flussi. Cambiarlo (seedRandom) fa ripartire i thread.
+    struct RandomSeed {
+        atomic<uint64_t> seed{(uint64_t)chrono::steady_clock::now().time_since_epoch().count() ^
+                              (uint64_t)chrono::system_clock::now().time_since_epoch().count()};
+        atomic<unsigned> epoch{0};
+        atomic<int> nextStream{0};
+    };
 
-            rawModeEnabled = true;
+    inline RandomSeed &randomSeed() {
+        static RandomSeed instance;
+        return instance;
+    }
+}
+
+namespace pwetty {
+    // Flusso i del seme corrente: lo stesso seme e lo stesso i danno sempre gli stessi
+    // numeri, qualunque thread li usi. Per lavori paralleli riproducibili (banda i, ...).
+    inline Rng randomStream(int i) {
+        Rng r(detail::randomSeed().seed.load(memory_order_relaxed));
+        for (int k = 0; k < i; k++) r.jump();
+        return r;
+    }
+
+    // Il generatore del thread chiamante, senza lock. Ogni thread prende un suo flusso
+    // al primo uso; dopo seedRandom() chi l'ha chiamato ha il flusso 0.
+    inline Rng &rng() {
+        thread_local Rng r;
+        thread_local unsigned epoch = ~0u;
+        detail::RandomSeed &global = detail::randomSeed();
+        unsigned current = global.epoch.load(memory_order_acquire);
+        if (epoch != current) {
+            epoch = current;
+            r = randomStream(global.nextStream.fetch_add(1, memory_order_relaxed));
         }
+        return r;
+    }
 
-        void disableRawMode() {
-            if (!rawModeEnabled) return;
+    // Seme riproducibile per tutti i flussi (di default viene dall'orologio)
+    inline void seedRandom(uint64_t seed) {
+        detail::RandomSeed &global = detail::randomSeed();
+        global.seed.store(seed, memory_order_relaxed);
+        global.nextStream.store(0, memory_order_relaxed);
+        global.epoch.fetch_add(1, memory_order_release);
+        rng();
+    }
+}
 
-            #ifdef OS_LINUX
-                tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
-                cout << "\033[?1000l\033[?1003l\033[?1006l" << flush;
-            #endif
+// ======================== UNICODE ========================
+// Le celle contengono code point Unicode. La seconda cella di un glifo largo
+// contiene WIDE_TAIL e non viene mai stampata.
+const char32_t WIDE_TAIL = 0xFFFFFFFF;
 
-            #ifdef OS_WINDOWS
-                SetConsoleMode(hStdin, fdwSaveOldMode);
-            #endif
+namespace detail {
+    struct GlyphBytes {
+        char bytes[4];
+        uint8_t len;
+    };
 
-            rawModeEnabled = false;
+    inline GlyphBytes encodeUtf8(char32_t cp) {
+        GlyphBytes g{{0, 0, 0, 0}, 0};
+        if (cp < 0x80) {
+            g.bytes[0] = (char)cp; g.len = 1;
+        } else if (cp < 0x800) {
+            g.bytes[0] = (char)(0xC0 | (cp >> 6));
+            g.bytes[1] = (char)(0x80 | (cp & 0x3F));
+            g.len = 2;
+        } else if (cp < 0x10000) {
+            g.bytes[0] = (char)(0xE0 | (cp >> 12));
+            g.bytes[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            g.bytes[2] = (char)(0x80 | (cp & 0x3F));
+            g.len = 3;
+        } else if (cp < 0x110000) {
+            g.bytes[0] = (char)(0xF0 | (cp >> 18));
+            g.bytes[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            g.bytes[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            g.bytes[3] = (char)(0x80 | (cp & 0x3F));
+            g.len = 4;
+        } else {
+            g.bytes[0] = '?'; g.len = 1;
         }
+        return g;
+    }
 
-        // ======================== SIZE MANAGEMENT ========================
-        void getCurrentSize(int &w, int &h) const {
-            #ifdef OS_WINDOWS
-                CONSOLE_SCREEN_BUFFER_INFO csbi;
-                GetConsoleScreenBufferInfo(hConsole, &csbi);
-                w = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-                h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-            #else
-                struct winsize ws;
-                if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
-                    w = ws.ws_col;
-                    h = ws.ws_row;
-                } else {
-                    // se ioctl fallisce
-                    exit(1);
-                }
-            #endif
+    inline int computeGlyphWidth(char32_t cp) {
+        if (cp == 0) return 0;
+        if (cp < 0x300) return 1;
+        // Combining e zero-width
+        if ((cp >= 0x300 && cp <= 0x36F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+            (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x20D0 && cp <= 0x20FF) ||
+            (cp >= 0xFE20 && cp <= 0xFE2F) || (cp >= 0x200B && cp <= 0x200F) ||
+            (cp >= 0xFE00 && cp <= 0xFE0F))
+            return 0;
+        // East Asian Wide/Fullwidth ed emoji
+        if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0x303E) ||
+            (cp >= 0x3041 && cp <= 0x33FF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+            (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xA000 && cp <= 0xA4CF) ||
+            (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+            (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+            (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+            (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD))
+            return 2;
+        return 1;
+    }
+
+    // Cache dei glifi: la codifica UTF-8 e la larghezza si calcolano una volta per code point
+    class GlyphCache {
+    public:
+        static GlyphCache &get() {
+            static GlyphCache instance;
+            return instance;
         }
 
-        void initBuffersToCurrentSize() {
-            getCurrentSize(width, height);
-            if (width <= 0) width = 80;
-            if (height <= 0) height = 24;
-            
-            buffer.assign(height, vector<char>(width, ' '));
-            fgBuffer.assign(height, vector<Color>(width, DEFAULT_FG));
-            bgBuffer.assign(height, vector<Color>(width, DEFAULT_BG));
-            prevBuffer.assign(height, vector<char>(width, '\0'));
-            prevFgBuffer.assign(height, vector<Color>(width, DEFAULT_FG));
-            prevBgBuffer.assign(height, vector<Color>(width, DEFAULT_BG));
+        inline const GlyphBytes &bytes(char32_t cp) {
+            if (cp < 0x10000) {
+                GlyphBytes &g = bmpBytes[cp];
+                if (g.len == 0) g = encodeUtf8(cp ? cp : U' ');
+                return g;
+            }
+            // Fuori dal BMP (emoji): rari, ma l'encoder parallelo ci arriva da piu' thread
+            lock_guard<mutex> lock(otherMutex);
+            auto it = otherBytes.find(cp);
+            if (it == otherBytes.end())
+                it = otherBytes.emplace(cp, encodeUtf8(cp)).first;
+            return it->second;
         }
 
-        void ensureSize() {
-            int newW, newH;
-            getCurrentSize(newW, newH);
-            if (newW == width && newH == height)
-                return;
+        // Riempie subito tutta la tabella BMP: dopo bytes() non scrive piu' nel vettore
+        // e si puo' chiamare da piu' thread
+        void warmBmp() {
+            if (bmpWarm) return;
+            for (char32_t cp = 0; cp < 0x10000; cp++)
+                if (bmpBytes[cp].len == 0) bmpBytes[cp] = encodeUtf8(cp ? cp : U' ');
+            bmpWarm = true;
+        }
 
-            auto newBuffer = vector<vector<char>>(newH, vector<char>(newW, ' '));
-            auto newFgBuffer = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_FG));
-            auto newBgBuffer = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_BG));
-            auto newPrevBuf = vector<vector<char>>(newH, vector<char>(newW, '\0'));
-            auto newPrevFg = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_FG));
-            auto newPrevBg = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_BG));
+        inline int width(char32_t cp) {
+            if (cp < 0x10000) {
+                int8_t &w = bmpWidth[cp];
+                if (w < 0) w = (int8_t)computeGlyphWidth(cp);
+                return w;
+            }
+            auto it = otherWidth.find(cp);
+            if (it == otherWidth.end())
+                it = otherWidth.emplace(cp, (int8_t)computeGlyphWidth(cp)).first;
+            return it->second;
+        }
 
-            int copyH = min(height, newH);
-            int copyW = min(width, newW);
+    private:
+        vector<GlyphBytes> bmpBytes;
+        vector<int8_t> bmpWidth;
+        unordered_map<char32_t, GlyphBytes> otherBytes;
+        unordered_map<char32_t, int8_t> otherWidth;
+        mutex otherMutex;
+        bool bmpWarm = false;
 
-            for (int y = 0; y < copyH; ++y) {
-                for (int x = 0; x < copyW; ++x) {
-                    newBuffer[y][x] = buffer[y][x];
-                    newFgBuffer[y][x] = fgBuffer[y][x];
-                    newBgBuffer[y][x] = bgBuffer[y][x];
-                }
-            }
+        GlyphCache() : bmpBytes(0x10000, GlyphBytes{{0, 0, 0, 0}, 0}), bmpWidth(0x10000, -1) {}
+    };
 
-            width = newW;
-            height = newH;
-            buffer = move(newBuffer);
-            fgBuffer = move(newFgBuffer);
-            bgBuffer = move(newBgBuffer);
-            prevBuffer = move(newPrevBuf);
-            prevFgBuffer = move(newPrevFg);
-            prevBgBuffer = move(newPrevBg);
+    // Decodifica un code point e avanza p. I byte che non formano UTF-8 valido (anche
+    // forme troppo lunghe, surrogati, oltre U+10FFFF) vengono letti come CP437, cosi'
+    // le vecchie stringhe con (char)205 & co. continuano a funzionare. Non tutte pero':
+    // una coppia CP437 che e' anche UTF-8 valido, come "\xC9\xBB" (╔╗), diventa un solo
+    // carattere (U+027B). Per quelle si usa write(x, y, char) un byte alla volta.
+    char32_t cp437ToCodepoint(char c);
+
+    inline char32_t decodeUtf8(const char *&p, const char *end) {
+        unsigned char b = (unsigned char)*p;
+        if (b < 0x80) { p++; return b; }
+
+        // C0 e C1 darebbero solo forme troppo lunghe, da F5 in su si va oltre U+10FFFF
+        int len = (b >= 0xC2 && b <= 0xDF) ? 2 : (b >= 0xE0 && b <= 0xEF) ? 3 : (b >= 0xF0 && b <= 0xF4) ? 4 : 0;
+        if (len == 0 || p + len > end) { p++; return cp437ToCodepoint((char)b); }
+
+        char32_t cp = b & (0x7F >> len);
+        for (int i = 1; i < len; i++) {
+            unsigned char cb = (unsigned char)p[i];
+            if ((cb & 0xC0) != 0x80) { p++; return cp437ToCodepoint((char)b); }
+            cp = (cp << 6) | (cb & 0x3F);
+        }
+        static const char32_t minimum[5] = {0, 0, 0x80, 0x800, 0x10000};
+        if (cp < minimum[len] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+            p++;
+            return cp437ToCodepoint((char)b);
         }
+        p += len;
+        return cp;
+    }
 
-        // ======================== INPUT PARSING ========================
-        #ifdef OS_LINUX
-            void parseKeySequence(const string &seq) {
-                if(seq.empty()) return;
-                
-                if(seq[0] != '\033') {
-                    char c = seq[0];
-                    if(c >= 32 && c <= 126) keyQueue.push(c);
-                    else if(c == '\n' || c == '\r') keyQueue.push(KEY_ENTER);
-                    else if(c == '\t') keyQueue.push(KEY_TAB);
-                    else if(c == 127) keyQueue.push(KEY_BACKSPACE);
-                    else keyQueue.push(c);
-                    return;
-                }
-                
-                if(seq.size() < 3) {
-                    keyQueue.push(KEY_ESC);
-                    return;
-                }
-                
-                if(seq[1] == '[') {
-                    if(seq.size() == 3) {
-                        switch(seq[2]) {
-                            case 'A': keyQueue.push(KEY_UP); break;
-                            case 'B': keyQueue.push(KEY_DOWN); break;
-                            case 'C': keyQueue.push(KEY_RIGHT); break;
-                            case 'D': keyQueue.push(KEY_LEFT); break;
-                            case 'H': keyQueue.push(KEY_HOME); break;
-                            case 'F': keyQueue.push(KEY_END); break;
-                        }
-                        return;
-                    }
-                    
-                    int num = 0;
-                    if(sscanf(seq.c_str() + 2, "%d~", &num) == 1) {
-                        switch(num) {
-                            case 1: keyQueue.push(KEY_HOME); break;
-                            case 2: keyQueue.push(KEY_INSERT); break;
-                            case 3: keyQueue.push(KEY_DELETE); break;
-                            case 4: keyQueue.push(KEY_END); break;
-                            case 5: keyQueue.push(KEY_PAGEUP); break;
-                            case 6: keyQueue.push(KEY_PAGEDOWN); break;
-                        }
-                    }
-                }
+    inline char32_t cp437ToCodepoint(char c) {
+        if ((unsigned char)c < 0x80) return (unsigned char)c;
+        static const array<char32_t, 128> table = [] {
+            array<char32_t, 128> t{};
+            for (int i = 0; i < 128; i++) {
+                string utf8 = charToUnicode((char)(i + 128));
+                const char *p = utf8.data();
+                t[i] = decodeUtf8(p, p + utf8.size());
             }
+            return t;
+        }();
+        return table[(unsigned char)c - 128];
+    }
+}
 
-            void parseMouseSequence(const string &seq) {
-                if(seq.size() < 6) return;
-                if(seq[0] != '\033' || seq[1] != '[' || seq[2] != '<') return;
-                
-                int b = 0, x = 0, y = 0;
+inline int glyphWidth(char32_t cp) { return detail::GlyphCache::get().width(cp); }
+
+// Larghezza in celle di un testo UTF-8
+inline int textWidth(string_view text) {
+    int w = 0;
+    const char *p = text.data(), *end = p + text.size();
+    while (p < end)
+        w += glyphWidth(detail::decodeUtf8(p, end));
+    return w;
+}
+
+// ======================== TEXT FORMAT ========================
+// writef("Tempo: {}s  {:.1} fps  {:05}", ...) senza allocazioni: il testo si forma in
+// un buffer sullo stack e da li' va nelle celle.
+// {} / {0}       argomento successivo / per indice
+// {:N} {:<N} {:>N} larghezza minima (numeri a destra, testo a sinistra)
+// {:0N}          numeri con zeri davanti
+// {:.N}          cifre decimali per i float
+// {{ }}          parentesi letterali
+namespace detail {
+    struct FormatArg {
+        enum Type { Int, Uint, Float, Bool, Glyph, Text } type;
+        union {
+            long long i;
+            unsigned long long u;
+            double d;
+            bool b;
+            char32_t c;
+        };
+        string_view s;
+
+        FormatArg() : type(Int), i(0) {}
+
+        template <class T>
+        FormatArg(const T &v) {
+            if constexpr (is_same_v<T, bool>) { type = Bool; b = v; }
+            else if constexpr (is_same_v<T, char>) { type = Glyph; c = cp437ToCodepoint(v); }
+            else if constexpr (is_same_v<T, char32_t>) { type = Glyph; c = v; }
+            else if constexpr (is_integral_v<T> && is_signed_v<T>) { type = Int; i = v; }
+            else if constexpr (is_integral_v<T>) { type = Uint; u = v; }
+            else if constexpr (is_enum_v<T>) { type = Int; i = (long long)v; }
+            else if constexpr (is_floating_point_v<T>) { type = Float; d = v; }
+            else { type = Text; s = string_view(v); }
+        }
+    };
+
+    // Buffer di testo a capacita' fissa: oltre si tronca
+    struct FormatBuffer {
+        char data[512];
+        size_t len = 0;
+
+        void append(const char *p, size_t n) {
+            n = min(n, sizeof(data) - len);
+            memcpy(data + len, p, n);
+            len += n;
+        }
+        void append(string_view text) { append(text.data(), text.size()); }
+        void repeat(char ch, int n) {
+            while (n-- > 0 && len < sizeof(data)) data[len++] = ch;
+        }
+        string_view view() const { return string_view(data, len); }
+    };
+
+    inline void formatArg(FormatBuffer &out, const FormatArg &arg, char align, bool zero, int width, int precision) {
+        char tmp[64];
+        string_view text;
+        bool numeric = true;
+        switch (arg.type) {
+            case FormatArg::Int:
+                text = string_view(tmp, to_chars(tmp, tmp + sizeof(tmp), arg.i).ptr - tmp);
+                break;
+            case FormatArg::Uint:
+                text = string_view(tmp, to_chars(tmp, tmp + sizeof(tmp), arg.u).ptr - tmp);
+                break;
+            case FormatArg::Float: {
+                int n = precision >= 0 ? snprintf(tmp, sizeof(tmp), "%.*f", precision, arg.d)
+                                       : snprintf(tmp, sizeof(tmp), "%g", arg.d);
+                text = string_view(tmp, max(0, min(n, (int)sizeof(tmp) - 1)));
+                break;
+            }
+            case FormatArg::Bool:
+                text = arg.b ? "true" : "false";
+                numeric = false;
+                break;
+            case FormatArg::Glyph: {
+                GlyphBytes g = encodeUtf8(arg.c);
+                memcpy(tmp, g.bytes, g.len);
+                text = string_view(tmp, g.len);
+                numeric = false;
+                break;
+            }
+            case FormatArg::Text:
+                text = arg.s;
+                numeric = false;
+                break;
+        }
+
+        int pad = width - (numeric ? (int)text.size() : textWidth(text));
+        if (pad <= 0) { out.append(text); return; }
+        if (zero && numeric) {
+            // Gli zeri vanno dopo il segno
+            if (!text.empty() && text[0] == '-') { out.append("-", 1); text.remove_prefix(1); }
+            out.repeat('0', pad);
+            out.append(text);
+            return;
+        }
+        if (align == 0) align = numeric ? '>' : '<';
+        if (align == '>') out.repeat(' ', pad);
+        out.append(text);
+        if (align == '<') out.repeat(' ', pad);
+    }
+
+    inline void formatTo(FormatBuffer &out, string_view fmt, const FormatArg *args, size_t count) {
+        size_t next = 0;
+        size_t i = 0;
+        while (i < fmt.size()) {
+            char ch = fmt[i];
+            if (ch == '}' && i + 1 < fmt.size() && fmt[i + 1] == '}') { out.append("}", 1); i += 2; continue; }
+            if (ch != '{') { out.append(&fmt[i], 1); i++; continue; }
+            if (i + 1 < fmt.size() && fmt[i + 1] == '{') { out.append("{", 1); i += 2; continue; }
+
+            size_t close = fmt.find('}', i);
+            if (close == string_view::npos) { out.append(fmt.substr(i)); break; }
+            string_view spec = fmt.substr(i + 1, close - i - 1);
+            i = close + 1;
+
+            // Indice esplicito opzionale, poi :[<>][0][larghezza][.precisione]
+            size_t index = next;
+            size_t k = 0;
+            if (k < spec.size() && isdigit((unsigned char)spec[k])) {
+                index = 0;
+                while (k < spec.size() && isdigit((unsigned char)spec[k])) index = index * 10 + (spec[k++] - '0');
+            } else {
+                next++;
+            }
+            char align = 0;
+            bool zero = false;
+            int width = 0, precision = -1;
+            if (k < spec.size() && spec[k] == ':') {
+                k++;
+                if (k < spec.size() && (spec[k] == '<' || spec[k] == '>')) align = spec[k++];
+                if (k < spec.size() && spec[k] == '0') { zero = true; k++; }
+                while (k < spec.size() && isdigit((unsigned char)spec[k])) width = width * 10 + (spec[k++] - '0');
+                if (k < spec.size() && spec[k] == '.') {
+                    precision = 0;
+                    k++;
+                    while (k < spec.size() && isdigit((unsigned char)spec[k])) precision = precision * 10 + (spec[k++] - '0');
+                }
+            }
+            if (index < count)
+                formatArg(out, args[index], align, zero, width, precision);
+        }
+    }
+
+    template <class... Args>
+    inline void format(FormatBuffer &out, string_view fmt, const Args &...args) {
+        const array<FormatArg, sizeof...(Args)> list = {FormatArg(args)...};
+        formatTo(out, fmt, list.data(), list.size());
+    }
+}
+
+// ======================== LAYERS ========================
+inline Color blendColor(const Color &src, const Color &dst, int alpha) {
+    // I colori speciali (DEFAULT_*, CLEAR) non si possono mescolare
+    if (src.r < 0 || dst.r < 0)
+        return alpha >= 128 ? src : dst;
+    return Color(dst.r + (src.r - dst.r) * alpha / 255,
+                 dst.g + (src.g - dst.g) * alpha / 255,
+                 dst.b + (src.b - dst.b) * alpha / 255);
+}
+
+namespace detail {
+    struct Rect {
+        int x1, y1, x2, y2; // x2/y2 esclusi
+        bool empty() const { return x1 >= x2 || y1 >= y2; }
+        bool overlaps(const Rect &o) const {
+            return x1 <= o.x2 && o.x1 <= x2 && y1 <= o.y2 && o.y1 <= y2;
+        }
+        void merge(const Rect &o) {
+            x1 = min(x1, o.x1); y1 = min(y1, o.y1);
+            x2 = max(x2, o.x2); y2 = max(y2, o.y2);
+        }
+        Rect intersect(const Rect &o) const {
+            return {max(x1, o.x1), max(y1, o.y1), min(x2, o.x2), min(y2, o.y2)};
+        }
+        bool contains(int x, int y) const { return x >= x1 && x < x2 && y >= y1 && y < y2; }
+    };
+
+    // Aggiunge r a una lista di regioni unendolo a quella che tocca; oltre 16 regioni
+    // diventano una sola
+    inline void addRegion(vector<Rect> &regions, const Rect &r) {
+        if (r.empty()) return;
+        for (auto &other : regions) {
+            if (other.overlaps(r)) {
+                other.merge(r);
+                return;
+            }
+        }
+        if (regions.size() < 16) {
+            regions.push_back(r);
+            return;
+        }
+        Rect all = r;
+        for (auto &other : regions) all.merge(other);
+        regions.assign(1, all);
+    }
+
+    // Trasformazione attiva durante il disegno di una View: origine e clip in celle schermo
+    struct ViewState {
+        bool active = false;
+        int originX = 0, originY = 0;
+        int w = 0, h = 0;  // dimensioni della vista in celle
+        Rect clip = {0, 0, 0, 0};
+        bool pixelMode = false;
+    };
+
+    // A named drawing surface with its own cells and per-cell alpha.
+    // Cells with alpha 0 (or bg == CLEAR) let the layers below show through.
+    struct Layer {
+        string name;
+        int z;
+        bool visible;
+        uint8_t opacity;
+        int width, height;
+        vector<vector<char32_t>> buffer;
+        vector<vector<Color>> fgBuffer, bgBuffer;
+        vector<vector<uint8_t>> alphaBuffer;
+        Rect dirty;
+        Rect bounds; // celle scritte dall'ultimo clear trasparente: fuori il layer e' vuoto
+
+        Layer(const string &layerName, int layerZ, int w, int h)
+            : name(layerName), z(layerZ), visible(true), opacity(255), width(0), height(0),
+              dirty{0, 0, 0, 0}, bounds{0, 0, 0, 0} {
+            resize(w, h);
+        }
+
+        void resize(int w, int h) {
+            buffer.resize(h);
+            fgBuffer.resize(h);
+            bgBuffer.resize(h);
+            alphaBuffer.resize(h);
+            for (int y = 0; y < h; ++y) {
+                buffer[y].resize(w, ' ');
+                fgBuffer[y].resize(w, DEFAULT_FG);
+                bgBuffer[y].resize(w, CLEAR);
+                alphaBuffer[y].resize(w, 0);
+            }
+            width = w;
+            height = h;
+            bounds = bounds.intersect({0, 0, w, h});
+            markDirty({0, 0, w, h});
+        }
+
+        void clear(const Color &bg) {
+            // DEFAULT_BG su un layer vuol dire "trasparente"
+            bool transparent = (bg == DEFAULT_BG || bg == CLEAR);
+            for (int y = 0; y < height; ++y) {
+                fill(buffer[y].begin(), buffer[y].end(), ' ');
+                fill(fgBuffer[y].begin(), fgBuffer[y].end(), DEFAULT_FG);
+                fill(bgBuffer[y].begin(), bgBuffer[y].end(), transparent ? CLEAR : bg);
+                fill(alphaBuffer[y].begin(), alphaBuffer[y].end(), transparent ? 0 : 255);
+            }
+            bounds = transparent ? Rect{0, 0, 0, 0} : Rect{0, 0, width, height};
+            markDirty({0, 0, width, height});
+        }
+
+        void put(int x, int y, char32_t c, const Color &fg, const Color &bg, uint8_t alpha) {
+            if (x < 0 || x >= width || y < 0 || y >= height) return;
+            buffer[y][x] = c;
+            if (fg != CLEAR) fgBuffer[y][x] = fg;
+            if (bg != CLEAR) bgBuffer[y][x] = bg;
+            alphaBuffer[y][x] = alpha;
+            markDirty({x, y, x + 1, y + 1});
+            markBounds({x, y, x + 1, y + 1});
+        }
+
+        char32_t cellAt(int x, int y) const {
+            if (x < 0 || x >= width || y < 0 || y >= height) return U' ';
+            return buffer[y][x];
+        }
+
+        void fillSpan(int x1, int x2, int y, char32_t c, const Color &fg, const Color &bg, uint8_t alpha) {
+            if (y < 0 || y >= height) return;
+            x1 = max(x1, 0);
+            x2 = min(x2, width - 1);
+            if (x1 > x2) return;
+            fill(buffer[y].begin() + x1, buffer[y].begin() + x2 + 1, c);
+            if (fg != CLEAR) fill(fgBuffer[y].begin() + x1, fgBuffer[y].begin() + x2 + 1, fg);
+            if (bg != CLEAR) fill(bgBuffer[y].begin() + x1, bgBuffer[y].begin() + x2 + 1, bg);
+            fill(alphaBuffer[y].begin() + x1, alphaBuffer[y].begin() + x2 + 1, alpha);
+            markDirty({x1, y, x2 + 1, y + 1});
+            markBounds({x1, y, x2 + 1, y + 1});
+        }
+
+        void markDirty(const Rect &r) {
+            if (r.empty()) return;
+            if (dirty.empty()) dirty = r;
+            else dirty.merge(r);
+        }
+
+        void markBounds(const Rect &r) {
+            if (bounds.empty()) bounds = r;
+            else bounds.merge(r);
+        }
+    };
+}
+
+// ======================== RECORDING ========================
+namespace detail {
+    #ifdef OS_LINUX
+        // Con l'fd non bloccante (setNonBlockingOutput, che vale anche per stdin sullo
+        // stesso tty) EAGAIN vuol dire terminale pieno: si dorme finche' non si svuota
+        // invece di riprovare a vuoto
+        inline void waitWritable(int fd) {
+            pollfd p = {fd, POLLOUT, 0};
+            while (poll(&p, 1, -1) < 0 && errno == EINTR) {}
+        }
+
+        // Scrive tutto il buffer su fd, gestendo scritture parziali e interruzioni
+        inline bool writeAll(int fd, const char *data, size_t len) {
+            while (len > 0) {
+                ssize_t n = ::write(fd, data, len);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN) { waitWritable(fd); continue; }
+                    return false;
+                }
+                data += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        // Come writeAll ma per un frame diviso in pezzi: writev a blocchi di IOV_MAX,
+        // senza copiarli in un unico buffer. iov e' solo spazio di lavoro riusato.
+        // Con wait = false si ferma appena il kernel non accetta altro (fd non bloccante).
+        // Ritorna i byte scritti, -1 in caso di errore.
+        inline ssize_t sendParts(int fd, const vector<const string *> &parts, vector<iovec> &iov, bool wait = true) {
+            iov.clear();
+            for (const string *part : parts)
+                if (!part->empty()) iov.push_back({(void *)part->data(), part->size()});
+
+            ssize_t sent = 0;
+            size_t i = 0;
+            while (i < iov.size()) {
+                int count = (int)min<size_t>(iov.size() - i, IOV_MAX);
+                ssize_t n = writev(fd, &iov[i], count);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN) return -1;
+                    if (!wait) break;
+                    waitWritable(fd);
+                    continue;
+                }
+                sent += n;
+                // Salta i pezzi scritti del tutto e accorcia quello scritto a meta'
+                while (i < iov.size() && (size_t)n >= iov[i].iov_len) {
+                    n -= iov[i].iov_len;
+                    i++;
+                }
+                if (n > 0) {
+                    iov[i].iov_base = (char *)iov[i].iov_base + n;
+                    iov[i].iov_len -= n;
+                }
+            }
+            return sent;
+        }
+    #endif
+
+    // Ring buffer di byte single-producer/single-consumer senza lock.
+    // Un record viene pubblicato tutto insieme oppure scartato.
+    class ByteRing {
+    public:
+        explicit ByteRing(size_t capacityPow2)
+            : data(capacityPow2), mask(capacityPow2 - 1), head(0), tail(0) {}
+
+        size_t capacity() const { return data.size(); }
+
+        // Producer: accoda a + b come un unico record
+        bool push(const void *a, size_t na, const void *b, size_t nb) {
+            size_t h = head.load(memory_order_relaxed);
+            size_t t = tail.load(memory_order_acquire);
+            if (data.size() - (h - t) < na + nb) return false;
+            copyIn(h, (const char *)a, na);
+            copyIn(h + na, (const char *)b, nb);
+            head.store(h + na + nb, memory_order_release);
+            return true;
+        }
+
+        // Producer: come sopra, con il corpo del record diviso in piu' pezzi
+        bool push(const void *a, size_t na, const vector<const string *> &parts) {
+            size_t total = na;
+            for (const string *part : parts) total += part->size();
+            size_t h = head.load(memory_order_relaxed);
+            size_t t = tail.load(memory_order_acquire);
+            if (data.size() - (h - t) < total) return false;
+            copyIn(h, (const char *)a, na);
+            size_t pos = h + na;
+            for (const string *part : parts) {
+                copyIn(pos, part->data(), part->size());
+                pos += part->size();
+            }
+            head.store(h + total, memory_order_release);
+            return true;
+        }
+
+        // Consumer: byte pronti da leggere
+        size_t available() const {
+            return head.load(memory_order_acquire) - tail.load(memory_order_relaxed);
+        }
+
+        void peek(void *out, size_t n) const { copyOut(tail.load(memory_order_relaxed), (char *)out, n); }
+
+        void pop(void *out, size_t n) {
+            size_t t = tail.load(memory_order_relaxed);
+            if (out) copyOut(t, (char *)out, n);
+            tail.store(t + n, memory_order_release);
+        }
+
+    private:
+        vector<char> data;
+        size_t mask;
+        alignas(64) atomic<size_t> head;
+        alignas(64) atomic<size_t> tail;
+
+        void copyIn(size_t pos, const char *src, size_t n) {
+            size_t start = pos & mask;
+            size_t first = min(n, data.size() - start);
+            memcpy(data.data() + start, src, first);
+            memcpy(data.data(), src + first, n - first);
+        }
+
+        void copyOut(size_t pos, char *dst, size_t n) const {
+            size_t start = pos & mask;
+            size_t first = min(n, data.size() - start);
+            memcpy(dst, data.data() + start, first);
+            memcpy(dst + first, data.data(), n - first);
+        }
+    };
+
+    inline void appendJsonString(string &out, const char *s, size_t n) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (size_t i = 0; i < n; i++) {
+            unsigned char c = (unsigned char)s[i];
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (c < 0x20 || c == 0x7F) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xF];
+                    } else {
+                        out += (char)c;
+                    }
+            }
+        }
+        out += '"';
+    }
+
+    // Registra l'output di render() in formato asciicast v2.
+    // render() copia solo i byte nel ring buffer; un thread in background scrive il file.
+    class Recorder {
+    public:
+        Recorder(const string &path, int w, int h, size_t capacityPow2 = 1 << 23)
+            : ring(capacityPow2), running(false), dropped(0), start(chrono::steady_clock::now()) {
+            file = fopen(path.c_str(), "w");
+            if (!file) return;
+
+            const char *term = getenv("TERM");
+            string header = "{\"version\": 2, \"width\": " + to_string(w) + ", \"height\": " + to_string(h) +
+                            ", \"timestamp\": " + to_string((long long)time(nullptr)) + ", \"env\": {\"TERM\": ";
+            appendJsonString(header, term ? term : "", term ? strlen(term) : 0);
+            header += "}}\n";
+            fputs(header.c_str(), file);
+
+            running = true;
+            worker = thread(&Recorder::run, this);
+        }
+
+        ~Recorder() { stop(); }
+
+        bool isOpen() const { return file != nullptr; }
+        size_t droppedFrames() const { return dropped.load(memory_order_relaxed); }
+
+        void frame(const string &output) { push('o', output.data(), output.size()); }
+
+        void frame(const vector<const string *> &parts) {
+            if (!file) return;
+            size_t n = 0;
+            for (const string *part : parts) n += part->size();
+            RecordHeader rh{elapsed(), (uint32_t)n, (uint32_t)'o'};
+            if (!ring.push(&rh, sizeof(rh), parts))
+                dropped.fetch_add(1, memory_order_relaxed);
+        }
+
+        void resize(int w, int h) {
+            string size = to_string(w) + "x" + to_string(h);
+            push('r', size.data(), size.size());
+        }
+
+        void stop() {
+            if (!file) return;
+            running = false;
+            if (worker.joinable()) worker.join();
+            fclose(file);
+            file = nullptr;
+        }
+
+    private:
+        struct RecordHeader {
+            double time;
+            uint32_t length;
+            uint32_t type;
+        };
+
+        FILE *file;
+        ByteRing ring;
+        thread worker;
+        atomic<bool> running;
+        atomic<size_t> dropped;
+        chrono::steady_clock::time_point start;
+
+        void push(char type, const char *bytes, size_t n) {
+            if (!file) return;
+            RecordHeader rh{elapsed(), (uint32_t)n, (uint32_t)type};
+            // Se il thread di scrittura e' indietro si perde il frame, ma render() non aspetta mai
+            if (!ring.push(&rh, sizeof(rh), bytes, n))
+                dropped.fetch_add(1, memory_order_relaxed);
+        }
+
+        double elapsed() const {
+            return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+
+        void run() {
+            string payload, line;
+            char time[32];
+            while (true) {
+                if (ring.available() < sizeof(RecordHeader)) {
+                    if (!running.load()) break;
+                    this_thread::sleep_for(chrono::milliseconds(5));
+                    continue;
+                }
+                RecordHeader rh;
+                ring.pop(&rh, sizeof(rh));
+                payload.resize(rh.length);
+                ring.pop(&payload[0], rh.length);
+
+                snprintf(time, sizeof(time), "%.6f", rh.time);
+                line = "[";
+                line += time;
+                line += rh.type == 'r' ? ", \"r\", " : ", \"o\", ";
+                appendJsonString(line, payload.data(), payload.size());
+                line += "]\n";
+                fwrite(line.data(), 1, line.size(), file);
+            }
+            fflush(file);
+        }
+    };
+}
+
+// ======================== FRAME ENCODER ========================
+// Funzionalita' opzionali del terminale usate dall'encoder
+struct Capabilities {
+    bool rep = false;           // CSI n b: ripete il carattere precedente
+    bool ech = true;            // CSI n X / CSI K: cancella con lo sfondo corrente
+    bool truecolor = true;      // SGR 38;2 / 48;2
+    bool syncOutput = false;    // modo 2026: il terminale mostra il frame tutto insieme
+    bool kittyKeyboard = false; // protocollo tastiera di kitty (CSI > flags u)
+    bool sixel = false;         // grafica sixel (DA1 con parametro 4)
+    bool kittyGraphics = false; // protocollo grafico di kitty (APC G)
+};
+
+// Contatori dell'output di render()
+struct OutputStats {
+    size_t framesPresented = 0; // frame arrivati al terminale per intero
+    size_t framesDropped = 0;   // frame (anche solo in parte) superati dal successivo
+    size_t bytesWritten = 0;
+    size_t bytesPending = 0;    // byte che il terminale non ha ancora accettato
+};
+
+namespace detail {
+    inline void appendInt(string &out, int v) {
+        char tmp[12];
+        int n = 0;
+        unsigned u = v < 0 ? (out += '-', (unsigned)-v) : (unsigned)v;
+        do { tmp[n++] = (char)('0' + u % 10); u /= 10; } while (u);
+        while (n) out += tmp[--n];
+    }
+
+    inline int digits(int v) {
+        int n = 1;
+        while (v >= 10) { v /= 10; n++; }
+        return n;
+    }
+
+    // I colori del tema come SGR 30-37 / 90-97 (40-47 / 100-107 per lo sfondo)
+    inline void appendPaletteColor(string &out, int index, int base) {
+        out += "\033[";
+        appendInt(out, index < 8 ? base + index : base + 60 + index - 8);
+        out += 'm';
+    }
+
+    inline void appendFg(string &out, const Color &c) {
+        if (c == DEFAULT_FG) { out += "\033[39m"; return; }
+        if (int i = paletteIndex(c); i >= 0) { appendPaletteColor(out, i, 30); return; }
+        out += "\033[38;2;";
+        appendInt(out, c.r); out += ';';
+        appendInt(out, c.g); out += ';';
+        appendInt(out, c.b); out += 'm';
+    }
+
+    inline void appendBg(string &out, const Color &c) {
+        if (c == DEFAULT_BG) { out += "\033[49m"; return; }
+        if (int i = paletteIndex(c); i >= 0) { appendPaletteColor(out, i, 40); return; }
+        out += "\033[48;2;";
+        appendInt(out, c.r); out += ';';
+        appendInt(out, c.g); out += ';';
+        appendInt(out, c.b); out += 'm';
+    }
+
+    // Stato del terminale mentre si codifica un frame (-1 / UNKNOWN = da reimpostare)
+    const Color UNKNOWN_COLOR = {-9, -9, -9};
+
+    struct EncoderState {
+        int cursorX = -1, cursorY = -1;
+        Color fg = UNKNOWN_COLOR, bg = UNKNOWN_COLOR;
+    };
+
+    inline void moveCursor(string &out, EncoderState &st, int x, int y) {
+        if (st.cursorY == y && st.cursorX == x) return;
+        if (st.cursorY == y && st.cursorX >= 0 && x > st.cursorX && x - st.cursorX < 100) {
+            out += "\033[";
+            appendInt(out, x - st.cursorX);
+            out += 'C';
+        } else {
+            out += "\033[";
+            appendInt(out, y + 1); out += ';';
+            appendInt(out, x + 1); out += 'H';
+        }
+        st.cursorX = x;
+        st.cursorY = y;
+    }
+
+    template <class Model>
+    inline void setColors(string &out, EncoderState &st, const Color &fg, const Color &bg) {
+        if (st.fg != fg) { Model::appendFg(out, fg); st.fg = fg; }
+        if (st.bg != bg) { Model::appendBg(out, bg); st.bg = bg; }
+    }
+
+    // Emette n copie di un glifo stretto, scegliendo la forma piu' corta tra
+    // testo ripetuto, REP e le cancellazioni ECH/EL (solo per gli spazi)
+    inline void emitRun(string &out, EncoderState &st, const Capabilities &caps,
+                        const GlyphBytes &glyph, bool blank, int n, int rowWidth) {
+        int literal = n * glyph.len;
+        bool toEol = (st.cursorX + n >= rowWidth);
+        int rep = (caps.rep && n > 1) ? glyph.len + 3 + digits(n - 1) : INT32_MAX;
+
+        if (blank && caps.ech && n > 1) {
+            if (toEol && 3 < min(literal, rep)) {
+                out += "\033[K";
+                st.cursorX = -1; // il cursore non si e' mosso, meglio riposizionarlo
+                return;
+            }
+            int ech = 3 + digits(n) + 3 + digits(n);
+            if (!toEol && ech < min(literal, rep)) {
+                out += "\033["; appendInt(out, n); out += 'X';
+                out += "\033["; appendInt(out, n); out += 'C';
+                st.cursorX += n;
+                return;
+            }
+        }
+
+        if (rep < literal) {
+            out.append(glyph.bytes, glyph.len);
+            out += "\033["; appendInt(out, n - 1); out += 'b';
+        } else {
+            for (int i = 0; i < n; i++)
+                out.append(glyph.bytes, glyph.len);
+        }
+        st.cursorX += n;
+        // Sull'ultima colonna il cursore resta in attesa di andare a capo
+        if (st.cursorX >= rowWidth) st.cursorX = -1;
+    }
+
+    // Lo schermo e' diviso in tile da 16x8 celle. L'hash di una tile e' lo XOR degli hash
+    // delle sue celle (contenuto e posizione nella tile): scrivere una cella toglie il
+    // suo hash vecchio e aggiunge il nuovo, e ridisegnare lo stesso contenuto riporta
+    // la tile all'hash di prima.
+    const int TILE_W = 16, TILE_H = 8;
+
+    inline uint64_t mixHash(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    inline uint64_t colorKey(const Color &c) {
+        return (uint64_t)(c.r & 0x3FF) | (uint64_t)(c.g & 0x3FF) << 10 | (uint64_t)(c.b & 0x3FF) << 20;
+    }
+
+    inline uint64_t cellHash(int x, int y, char32_t ch, const Color &fg, const Color &bg) {
+        uint64_t pos = (uint64_t)((y % TILE_H) * TILE_W + x % TILE_W);
+        return mixHash(((uint64_t)ch << 7 | pos) ^ colorKey(fg) * 0x9E3779B97F4A7C15ull ^
+                       colorKey(bg) * 0xC2B2AE3D27D4EB4Full);
+    }
+}
+
+// ======================== COLOR MODELS ========================
+// Policy per BasicConsole e per l'encoder: come un Color diventa una sequenza SGR
+// reduce() e' il colore che il terminale mostrera' davvero: l'encoder confronta e
+// raggruppa le celle con quello, quindi due colori con la stessa riduzione sono uguali.
+struct TrueColorModel {
+    static Color reduce(const Color &c) { return c; }
+    static void appendFg(string &out, const Color &c) { detail::appendFg(out, c); }
+    static void appendBg(string &out, const Color &c) { detail::appendBg(out, c); }
+};
+
+// xterm-256: cubo 6x6x6 (16-231) e scala di grigi (232-255)
+struct Color256Model {
+    static Color reduce(const Color &c) { return c; }
+    static int cubeLevel(int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; }
+
+    static int index(const Color &c) {
+        if (int i = paletteIndex(c); i >= 0) return i; // colori del tema, esatti
+        static const int levels[6] = {0, 95, 135, 175, 215, 255};
+        int r = cubeLevel(c.r), g = cubeLevel(c.g), b = cubeLevel(c.b);
+        int cr = levels[r], cg = levels[g], cb = levels[b];
+
+        int avg = (c.r + c.g + c.b) / 3;
+        int grayIdx = avg > 238 ? 23 : max(0, (avg - 3) / 10);
+        int gv = 8 + grayIdx * 10;
+
+        auto dist = [&](int x, int y, int z) {
+            return (c.r - x) * (c.r - x) + (c.g - y) * (c.g - y) + (c.b - z) * (c.b - z);
+        };
+        if (dist(gv, gv, gv) < dist(cr, cg, cb))
+            return 232 + grayIdx;
+        return 16 + 36 * r + 6 * g + b;
+    }
+
+    static void appendFg(string &out, const Color &c) {
+        if (c == DEFAULT_FG) { out += "\033[39m"; return; }
+        out += "\033[38;5;";
+        detail::appendInt(out, index(c));
+        out += 'm';
+    }
+
+    static void appendBg(string &out, const Color &c) {
+        if (c == DEFAULT_BG) { out += "\033[49m"; return; }
+        out += "\033[48;5;";
+        detail::appendInt(out, index(c));
+        out += 'm';
+    }
+};
+
+// Modelli della qualita' adattiva (setAdaptiveQuality): con i colori ridotti prima
+// del confronto le sfumature diventano run di celle uguali e i colori che cambiano di
+// poco non fanno reinviare la cella.
+
+// Truecolor a 4 bit per canale
+struct Quantized4Model : TrueColorModel {
+    static int level(int v) { return (v & 0xf0) | (v >> 4); }
+    static Color reduce(const Color &c) {
+        if (c.r < 0) return c; // DEFAULT_FG, DEFAULT_BG
+        return Color(level(c.r), level(c.g), level(c.b));
+    }
+};
+
+// xterm-256 confrontando gia' il colore della palette
+struct Reduced256Model : Color256Model {
+    static Color reduce(const Color &c) {
+        if (c.r < 0) return c;
+        int i = index(c);
+        if (i >= 232) {
+            int v = 8 + (i - 232) * 10;
+            return Color(v, v, v);
+        }
+        static const int levels[6] = {0, 95, 135, 175, 215, 255};
+        i -= 16;
+        return Color(levels[i / 36], levels[(i / 6) % 6], levels[i % 6]);
+    }
+};
+
+enum class ColorDepth {
+    TrueColor,
+    Color256
+};
+
+// Policy di layout: quante celle occupa una x logica
+struct TextCells { static constexpr int cellsPerX = 1; };
+struct PixelCells { static constexpr int cellsPerX = 2; };
+
+// ======================== CELL ========================
+namespace pwetty {
+    // Contenuto di una cella, come lo restituisce uno shader di shade().
+    // ch == 0 lascia il glifo che c'e', fg/bg CLEAR lasciano il colore.
+    struct Cell {
+        char32_t ch = U' ';
+        Color fg = DEFAULT_FG;
+        Color bg = DEFAULT_BG;
+    };
+}
+
+// ======================== WORKER POOL ========================
+namespace detail {
+    // Thread persistenti per lavori divisi in parti indipendenti (bande di righe).
+    // run() distribuisce job(0..count-1) sui worker e sul thread chiamante e ritorna
+    // quando tutte le parti sono finite.
+    class WorkerPool {
+    public:
+        explicit WorkerPool(int threads) {
+            for (int i = 1; i < threads; i++)
+                workers.emplace_back(&WorkerPool::loop, this);
+        }
+
+        ~WorkerPool() {
+            {
+                lock_guard<mutex> lock(m);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &t : workers) t.join();
+        }
+
+        int size() const { return (int)workers.size() + 1; }
+
+        void run(int count, const function<void(int)> &job) {
+            if (count <= 0) return;
+            {
+                lock_guard<mutex> lock(m);
+                current = &job;
+                total = count;
+                next = 0;
+                pending = count;
+                generation++;
+            }
+            wake.notify_all();
+            work();
+
+            unique_lock<mutex> lock(m);
+            done.wait(lock, [this] { return pending == 0; });
+            current = nullptr;
+        }
+
+    private:
+        vector<thread> workers;
+        mutex m;
+        condition_variable wake, done;
+        const function<void(int)> *current = nullptr;
+        int total = 0, next = 0, pending = 0;
+        unsigned generation = 0;
+        bool stopping = false;
+
+        void work() {
+            unique_lock<mutex> lock(m);
+            while (next < total) {
+                int i = next++;
+                const function<void(int)> *job = current;
+                lock.unlock();
+                (*job)(i);
+                lock.lock();
+                if (--pending == 0) done.notify_all();
+            }
+        }
+
+        void loop() {
+            unsigned seen = 0;
+            while (true) {
+                {
+                    unique_lock<mutex> lock(m);
+                    wake.wait(lock, [&] { return stopping || generation != seen; });
+                    if (stopping) return;
+                    seen = generation;
+                }
+                work();
+            }
+        }
+    };
+}
+
+// ======================== SHARING ========================
+#ifdef OS_LINUX
+namespace detail {
+    // Un terminale collegato al socket di startSharing(): riceve lo stesso schermo del
+    // terminale principale, ritagliato sulle sue dimensioni e codificato con la sua
+    // profondita' colore, con un diff tutto suo
+    struct Viewer {
+        int fd = -1;
+        bool ready = false;           // handshake ricevuto
+        int width = 0, height = 0;
+        ColorDepth depth = ColorDepth::TrueColor;
+        Capabilities caps;
+        string input;                 // righe di controllo non ancora complete
+        int consoleWidth = 0, consoleHeight = 0;
+        bool clearScreen = false;
+        vector<vector<char32_t>> prevBuffer;
+        vector<vector<Color>> prevFgBuffer, prevBgBuffer;
+        string frame, pending;
+        size_t framesDropped = 0;
+
+        ~Viewer() { if (fd >= 0) close(fd); }
+
+        // Il terminale del viewer va ridisegnato da zero
+        void reset(int consoleW, int consoleH) {
+            consoleWidth = consoleW;
+            consoleHeight = consoleH;
+            prevBuffer.assign(height, vector<char32_t>(width, U'\0'));
+            prevFgBuffer.assign(height, vector<Color>(width, DEFAULT_FG));
+            prevBgBuffer.assign(height, vector<Color>(width, DEFAULT_BG));
+            clearScreen = true;
+        }
+
+        // "pwetty-view 1 W H truecolor|256 [sync] [rep]" all'inizio, poi "size W H".
+        // false se la riga non ha senso e il viewer va chiuso.
+        bool handleLine(const string &line) {
+            int version, w, h;
+            char depthName[16] = "", flag1[16] = "", flag2[16] = "";
+            if (!ready && sscanf(line.c_str(), "pwetty-view %d %d %d %15s %15s %15s",
+                                 &version, &w, &h, depthName, flag1, flag2) >= 4) {
+                if (version != 1) return false;
+                depth = strcmp(depthName, "256") == 0 ? ColorDepth::Color256 : ColorDepth::TrueColor;
+                caps = Capabilities();
+                caps.truecolor = depth == ColorDepth::TrueColor;
+                for (const char *f : {flag1, flag2}) {
+                    if (strcmp(f, "sync") == 0) caps.syncOutput = true;
+                    if (strcmp(f, "rep") == 0) caps.rep = true;
+                }
+                ready = true;
+            } else if (ready && sscanf(line.c_str(), "size %d %d", &w, &h) == 2) {
+                if (w == width && h == height) return true;
+            } else {
+                return false;
+            }
+            width = max(1, min(w, 1000));
+            height = max(1, min(h, 1000));
+            consoleWidth = -1; // reset al prossimo frame
+            return true;
+        }
+    };
+}
+#endif
+
+// ======================== GRAPHICS PLACEMENTS ========================
+namespace detail {
+    // Un'immagine mostrata con un protocollo grafico (sixel o kitty) sopra un
+    // rettangolo di celle. encode scrive il payload con il cursore gia' in (x, y).
+    struct GraphicPlacement {
+        int x = 0, y = 0, w = 0, h = 0;
+        uint64_t key = 0;       // contenuto, dimensione in pixel e ritaglio
+        bool kitty = false;
+        int placementId = 0;
+        function<void(string &out, int imageId, int placementId)> encode;
+
+        bool sameAs(const GraphicPlacement &o) const {
+            return key == o.key && kitty == o.kitty && x == o.x && y == o.y && w == o.w && h == o.h;
+        }
+        // Id dell'immagine nella memoria del terminale (kitty), mai 0
+        int imageId() const {
+            int id = (int)((key ^ (key >> 32)) & 0x7FFFFFFF);
+            return id ? id : 1;
+        }
+    };
+}
+
+// ======================== CONSOLE SINGLETON ========================
+namespace detail {
+    class Console {
+    public:
+        // Dimensioni e buffer
+        int width, height;
+        vector<vector<char32_t>> buffer, prevBuffer;
+        vector<vector<Color>> fgBuffer, bgBuffer, prevFgBuffer, prevBgBuffer;
+        bool pixelMode;
+        bool rawModeEnabled;
+
+        // Layers (ordinati per z, dal basso verso l'alto)
+        vector<unique_ptr<Layer>> layers;
+        Layer *activeLayer;
+        uint8_t drawAlpha;
+        bool fullRecompose;
+        // Con dei layer il disegno diretto sullo schermo finisce anche nel piano base, che
+        // composite() usa come fondo. baseDirty: zone del piano base cambiate sotto un layer.
+        vector<vector<char32_t>> baseBuffer;
+        vector<vector<Color>> baseFgBuffer, baseBgBuffer;
+        vector<Rect> baseDirty;
+
+        // Vista attiva: putCell e fillSpan spostano e ritagliano le coordinate
+        ViewState view;
+
+        // Celle esterne (IndexedConsole): finche' externalCells > 0 i buffer qui sopra sono
+        // vuoti, width e height valgono 0 e lo schermo e' externalWidth x externalHeight.
+        // externalRowsLost: righe di un frame esterno che il terminale non ha ricevuto.
+        int externalCells;
+        int externalWidth, externalHeight;
+        vector<char> externalRowsLost;
+
+        // Output
+        Capabilities caps;
+        ColorDepth colorDepth;
+        string terminalName;
+        bool probeReplied;
+        bool probing; // probeCapabilities() aspetta le risposte
+        unique_ptr<detail::Recorder> recorder;
+        #ifdef OS_LINUX
+            int outputFd;
+        #endif
+
+        // Thread condivisi da encoder e shade(), creati al primo uso (uno per core)
+        unique_ptr<detail::WorkerPool> pool;
+        // Encoding parallelo a bande di righe (1 = tutto sul thread di render)
+        int encodeThreads;
+
+        // Frame codificato: testa, una stringa per riga (riusate tra i frame) e coda.
+        // present() passa i pezzi al kernel cosi' come sono, senza unirli.
+        string frameHead, frameTail;
+        vector<string> rowOutput;
+        vector<const string *> frameParts;
+        vector<int> framePartRows; // riga di ogni pezzo, -1 per testa e coda, -2 per le immagini
+        // Immagini con protocollo grafico: quelle disegnate in questo frame, quelle che il
+        // terminale mostra e quelle che kitty tiene in memoria (le piu' vecchie prima)
+        vector<detail::GraphicPlacement> graphics, graphicsShown;
+        vector<int> kittyImages;
+        int lastPlacementId;
+        bool graphicsLost;
+        string frameGraphics;
+        OutputStats stats;
+        // Qualita' adattiva (setAdaptiveQuality): livello 0 = piena, 3 = minima
+        bool adaptiveQuality;
+        int qualityLevel;
+        int qualityTargetFps;
+        double outputLoad; // media mobile del tempo di scrittura in frame (1 = un frame intero)
+        int framesSinceQualityChange, qualityUpWait;
+        bool lastQualityChangeUp, skipLoadSample;
+        // Righe da ridisegnare per intero (invalidate, resize): la loro codifica completa
+        // resta in cache insieme al contenuto da cui e' nata, e se la riga e' ancora
+        // uguale si rimanda la stessa stringa senza ricodificarla
+        vector<char> rowInvalid, rowCacheValid;
+        vector<string> rowCache;
+        vector<vector<char32_t>> cacheBuffer;
+        vector<vector<Color>> cacheFgBuffer, cacheBgBuffer;
+        // Hash delle tile 16x8 (vedi detail::cellHash): com'e' ora e com'era all'ultimo
+        // frame. render() guarda solo le tile con l'hash cambiato. Chi scrive in blocco
+        // (shade, layer, BasicConsole, IndexedConsole) segna la tile come stale e il suo
+        // hash si ricalcola al render.
+        int tilesX, tilesY;
+        vector<uint64_t> tileHash, shownTileHash;
+        vector<char> tileStale, tileChanged;
+        vector<uint8_t> tileActivity; // quanto spesso cambia la tile (255 = a ogni frame)
+        uint32_t tileFrame;
+        #ifdef OS_LINUX
+            vector<iovec> iovScratch;
+            // Condivisione dello schermo su un socket unix (startSharing)
+            int shareFd;
+            string sharePath;
+            vector<unique_ptr<detail::Viewer>> viewers;
+            vector<detail::Viewer *> viewersDue;
+            // Output non bloccante: la parte di frame che il terminale non ha ancora preso
+            bool nonBlockingOutput;
+            int savedOutputFlags;
+            string pendingOutput;
+        #endif
+
+        // Input
+        queue<int> keyQueue;
+        int mouseX, mouseY;
+        bool mouseButtonDown[8];
+        bool mouseButtonPressed[8];
+        bool mouseButtonReleased[8];
+        // Tasti giu': ASCII (lettere minuscole) e poi KEY_UP..KEY_DELETE
+        static const int KEY_STATES = 128 + KEY_DELETE - KEY_UP + 1;
+        bool keyDown[KEY_STATES];
+        bool keyJustPressed[KEY_STATES];
+        bool keyJustReleased[KEY_STATES];
+        vector<int> keyTaps; // tasti senza rilascio noto: si rilasciano al frame dopo
+        // Press/repeat/release separati: protocollo di kitty (Linux) o console Windows
+        bool keyEvents;
+
+        #ifdef OS_WINDOWS
+            HANDLE hConsole;
+            HANDLE hStdin;
+            DWORD fdwSaveOldMode;
+            bool prevMouseButtonState[8];
+        #endif
+
+        #ifdef OS_LINUX
+            struct termios orig_termios;
+            string incompleteSequence;
+        #endif
+
+        Console() : mouseX(0), mouseY(0), pixelMode(false), rawModeEnabled(false),
+                    activeLayer(nullptr), drawAlpha(255), fullRecompose(false), encodeThreads(1),
+                    lastPlacementId(0), graphicsLost(false), adaptiveQuality(false), qualityLevel(0),
+                    qualityTargetFps(30), outputLoad(0), framesSinceQualityChange(0), qualityUpWait(60),
+                    lastQualityChangeUp(false), skipLoadSample(false), tileFrame(0),
+                    externalCells(0), externalWidth(0), externalHeight(0) {
+            #ifdef OS_LINUX
+                outputFd = STDOUT_FILENO;
+                shareFd = -1;
+                nonBlockingOutput = false;
+                savedOutputFlags = 0;
+            #endif
+            caps = guessCapabilities();
+            probeReplied = false;
+            probing = false;
+            colorDepth = ColorDepth::TrueColor;
+            for(int i = 0; i < 8; i++) {
+                mouseButtonDown[i] = false;
+                mouseButtonPressed[i] = false;
+                mouseButtonReleased[i] = false;
+                #ifdef OS_WINDOWS
+                    prevMouseButtonState[i] = false;
+                #endif
+            }
+            clearKeyStates();
+            #ifdef OS_WINDOWS
+                keyEvents = true;
+            #else
+                keyEvents = false;
+            #endif
+            
+            #ifdef OS_WINDOWS
+                hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+                hStdin = GetStdHandle(STD_INPUT_HANDLE);
+                SetConsoleOutputCP(CP_UTF8);
+            #endif
+
+            setupSignalHandler();
+            enableRawMode();
+            initBuffersToCurrentSize();
+            #ifdef OS_LINUX
+                if (!loadCapabilityCache())
+                    probeCapabilities();
+            #endif
+            #ifdef PWETTY_COLOR_256
+                colorDepth = ColorDepth::Color256;
+            #else
+                colorDepth = caps.truecolor ? ColorDepth::TrueColor : ColorDepth::Color256;
+            #endif
+        }
+
+        ~Console() {
+            #ifdef OS_LINUX
+                stopSharing();
+            #endif
+            disableRawMode();
+        }
+
+        // ======================== SIGNAL HANDLERS ========================
+        #ifdef OS_WINDOWS
+            static BOOL WINAPI handle_ctrl_c(DWORD type) {
+                if (type == CTRL_C_EVENT) {
+                    Console::get().cleanup();
+                }
+                return FALSE;
+            }
+
+            void setupSignalHandler() {
+                SetConsoleCtrlHandler(handle_ctrl_c, TRUE);
+            }
+        #else
+            static void handle_sigint(int sig) {
+                (void)sig;
+                Console::get().cleanup();
+                exit(0);
+            }
+
+            void setupSignalHandler() {
+                signal(SIGINT, handle_sigint);
+                signal(SIGTERM, handle_sigint);
+            }
+        #endif
+
+        // ======================== RAW MODE ========================
+        void enableRawMode() {
+            if (rawModeEnabled) return;
+
+            #ifdef OS_LINUX
+                if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) {
+                    return;
+                }
+                
+                struct termios raw = orig_termios;
+                raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+                raw.c_iflag &= ~(IXON | ICRNL | BRKINT | INPCK | ISTRIP);
+                raw.c_oflag &= ~(OPOST);
+                raw.c_cflag |= CS8;
+                raw.c_cc[VMIN] = 0;  // Cambiato a 0 per lettura non bloccante
+                raw.c_cc[VTIME] = 1; // Timeout di 0.1 secondi
+                
+                if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+                    perror("tcsetattr");
+                    return;
+                }
+                
+                // Mouse reporting
+                cout << "\033[?1000h\033[?1003h\033[?1006h" << flush;
+                fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+            #endif
+
+            #ifdef OS_WINDOWS
+                GetConsoleMode(hStdin, &fdwSaveOldMode);
+                DWORD fdwMode = ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT;
+                SetConsoleMode(hStdin, fdwMode);
+            #endif
+
+            rawModeEnabled = true;
+        }
+
+        void disableRawMode() {
+            if (!rawModeEnabled) return;
+
+            #ifdef OS_LINUX
+                tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+                cout << "\033[?1000l\033[?1003l\033[?1006l" << flush;
+                enableKeyEvents(false);
+            #endif
+
+            #ifdef OS_WINDOWS
+                SetConsoleMode(hStdin, fdwSaveOldMode);
+            #endif
+
+            rawModeEnabled = false;
+        }
+
+        // ======================== SIZE MANAGEMENT ========================
+        void getCurrentSize(int &w, int &h) const {
+            #ifdef OS_WINDOWS
+                CONSOLE_SCREEN_BUFFER_INFO csbi;
+                GetConsoleScreenBufferInfo(hConsole, &csbi);
+                w = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+                h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+            #else
+                struct winsize ws;
+                if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+                    w = ws.ws_col;
+                    h = ws.ws_row;
+                } else {
+                    // se ioctl fallisce
+                    exit(1);
+                }
+            #endif
+        }
+
+        void initBuffersToCurrentSize() {
+            getCurrentSize(width, height);
+            if (width <= 0) width = 80;
+            if (height <= 0) height = 24;
+            
+            buffer.assign(height, vector<char32_t>(width, U' '));
+            fgBuffer.assign(height, vector<Color>(width, DEFAULT_FG));
+            bgBuffer.assign(height, vector<Color>(width, DEFAULT_BG));
+            prevBuffer.assign(height, vector<char32_t>(width, U'\0'));
+            prevFgBuffer.assign(height, vector<Color>(width, DEFAULT_FG));
+            prevBgBuffer.assign(height, vector<Color>(width, DEFAULT_BG));
+            resizeRowStorage();
+        }
+
+        // Stato per riga dell'encoder: dopo un cambio di dimensione si riparte da zero
+        void resizeRowStorage() {
+            rowOutput.resize(height);
+            rowCache.resize(height);
+            cacheBuffer.assign(height, {});
+            cacheFgBuffer.assign(height, {});
+            cacheBgBuffer.assign(height, {});
+            rowCacheValid.assign(height, 0);
+            rowInvalid.assign(height, 1);
+            graphicsLost = true;
+
+            tilesX = (width + detail::TILE_W - 1) / detail::TILE_W;
+            tilesY = (height + detail::TILE_H - 1) / detail::TILE_H;
+            tileHash.assign(tilesX * tilesY, 0);
+            shownTileHash.assign(tilesX * tilesY, 0);
+            tileStale.assign(tilesX * tilesY, 1);
+            tileChanged.assign(tilesX * tilesY, 1);
+            tileActivity.assign(tilesX * tilesY, 0);
+            forgetTiles(0, 0, width, height);
+        }
+
+        // ======================== TILE HASHES ========================
+        int tileIndex(int x, int y) const { return (y / detail::TILE_H) * tilesX + x / detail::TILE_W; }
+
+        // Scrive una cella aggiornando l'hash della sua tile
+        inline void storeCell(int x, int y, char32_t c, const Color &fg, const Color &bg) {
+            char32_t &cell = buffer[y][x];
+            Color &cellFg = fgBuffer[y][x], &cellBg = bgBuffer[y][x];
+            uint64_t before = detail::cellHash(x, y, cell, cellFg, cellBg);
+            cell = c;
+            if (fg != CLEAR) cellFg = fg;
+            if (bg != CLEAR) cellBg = bg;
+            tileHash[tileIndex(x, y)] ^= before ^ detail::cellHash(x, y, cell, cellFg, cellBg);
+            if (!layers.empty()) storeBase(x, y, c, fg, bg);
+        }
+
+        // Scrittura diretta con dei layer: il piano base si aggiorna sempre, e se la
+        // cella e' sotto un layer la ricompone il prossimo render()
+        void storeBase(int x, int y, char32_t c, const Color &fg, const Color &bg) {
+            baseBuffer[y][x] = c;
+            if (fg != CLEAR) baseFgBuffer[y][x] = fg;
+            if (bg != CLEAR) baseBgBuffer[y][x] = bg;
+            for (auto &layer : layers) {
+                if (layer->bounds.contains(x, y)) {
+                    addRegion(baseDirty, {x, y, x + 1, y + 1});
+                    return;
+                }
+            }
+        }
+
+        // Il piano base e' cambiato in r: si ricompongono le parti coperte da un layer
+        void markBaseDirty(const Rect &r) {
+            for (auto &layer : layers)
+                addRegion(baseDirty, r.intersect(layer->bounds));
+        }
+
+        // Le celle del disegno diretto: il piano base se ci sono layer, se no lo schermo
+        vector<vector<char32_t>> &basePlane() { return layers.empty() ? buffer : baseBuffer; }
+        const vector<vector<char32_t>> &basePlane() const { return layers.empty() ? buffer : baseBuffer; }
+
+        inline void markStale(int x, int y) { tileStale[tileIndex(x, y)] = 1; }
+
+        // Celle [x1, x2) x [y1, y2) scritte direttamente nei buffer
+        void markStale(int x1, int y1, int x2, int y2) {
+            x1 = max(x1, 0); y1 = max(y1, 0);
+            x2 = min(x2, width); y2 = min(y2, height);
+            if (x1 >= x2 || y1 >= y2) return;
+            for (int ty = y1 / detail::TILE_H; ty <= (y2 - 1) / detail::TILE_H; ty++)
+                for (int tx = x1 / detail::TILE_W; tx <= (x2 - 1) / detail::TILE_W; tx++)
+                    tileStale[ty * tilesX + tx] = 1;
+        }
+
+        // Il terminale non mostra piu' quello che dice prevBuffer nelle tile della regione
+        void forgetTiles(int x1, int y1, int x2, int y2) {
+            x1 = max(x1, 0); y1 = max(y1, 0);
+            x2 = min(x2, width); y2 = min(y2, height);
+            if (x1 >= x2 || y1 >= y2) return;
+            for (int ty = y1 / detail::TILE_H; ty <= (y2 - 1) / detail::TILE_H; ty++)
+                for (int tx = x1 / detail::TILE_W; tx <= (x2 - 1) / detail::TILE_W; tx++) {
+                    int t = ty * tilesX + tx;
+                    shownTileHash[t] = tileHash[t] ^ 1;
+                    tileStale[t] = 1;
+                }
+        }
+
+        uint64_t computeTileHash(int t) const {
+            int x1 = (t % tilesX) * detail::TILE_W, y1 = (t / tilesX) * detail::TILE_H;
+            int x2 = min(x1 + detail::TILE_W, width), y2 = min(y1 + detail::TILE_H, height);
+            uint64_t h = 0;
+            for (int y = y1; y < y2; y++)
+                for (int x = x1; x < x2; x++)
+                    h ^= detail::cellHash(x, y, buffer[y][x], fgBuffer[y][x], bgBuffer[y][x]);
+            return h;
+        }
+
+        // Ricalcola le tile stale e segna quelle diverse dall'ultimo frame
+        void refreshTiles() {
+            bool deferBusy = qualityLevel >= 3;
+            tileFrame++;
+            for (size_t t = 0; t < tileHash.size(); t++) {
+                if (tileStale[t]) {
+                    tileHash[t] = computeTileHash((int)t);
+                    tileStale[t] = 0;
+                }
+                bool changed = tileHash[t] != shownTileHash[t];
+                // Quanto spesso cambia la tile (media mobile, 255 = a ogni frame)
+                tileActivity[t] = (uint8_t)((tileActivity[t] * 7 + (changed ? 255 : 0)) / 8);
+                // Qualita' al minimo: le tile che cambiano quasi sempre si inviano un frame
+                // su tre (sfalsate). Lo shown non si aggiorna, quindi restano da inviare.
+                if (changed && deferBusy && tileActivity[t] > 128 && (tileFrame + t) % 3 != 0) {
+                    tileChanged[t] = 0;
+                    continue;
+                }
+                tileChanged[t] = changed;
+                shownTileHash[t] = tileHash[t];
+            }
+        }
+
+        void ensureSize() {
+            int newW, newH;
+            getCurrentSize(newW, newH);
+            if (externalCells) {
+                if (newW == externalWidth && newH == externalHeight) return;
+                externalWidth = newW;
+                externalHeight = newH;
+                externalRowsLost.assign(newH, 1);
+                if (recorder) recorder->resize(newW, newH);
+                return;
+            }
+            if (newW == width && newH == height)
+                return;
+            resizeCells(newW, newH);
+        }
+
+        void resizeCells(int newW, int newH) {
+            auto newBuffer = vector<vector<char32_t>>(newH, vector<char32_t>(newW, U' '));
+            auto newFgBuffer = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_FG));
+            auto newBgBuffer = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_BG));
+            auto newPrevBuf = vector<vector<char32_t>>(newH, vector<char32_t>(newW, U'\0'));
+            auto newPrevFg = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_FG));
+            auto newPrevBg = vector<vector<Color>>(newH, vector<Color>(newW, DEFAULT_BG));
+
+            int copyH = min(height, newH);
+            int copyW = min(width, newW);
+
+            for (int y = 0; y < copyH; ++y) {
+                for (int x = 0; x < copyW; ++x) {
+                    newBuffer[y][x] = buffer[y][x];
+                    newFgBuffer[y][x] = fgBuffer[y][x];
+                    newBgBuffer[y][x] = bgBuffer[y][x];
+                }
+            }
+
+            width = newW;
+            height = newH;
+            buffer = move(newBuffer);
+            fgBuffer = move(newFgBuffer);
+            bgBuffer = move(newBgBuffer);
+            prevBuffer = move(newPrevBuf);
+            prevFgBuffer = move(newPrevFg);
+            prevBgBuffer = move(newPrevBg);
+            resizeRowStorage();
+
+            if (!layers.empty()) resizeBasePlane();
+            for (auto &layer : layers)
+                layer->resize(width, height);
+            if (recorder && !externalCells)
+                recorder->resize(width, height);
+        }
+
+        // Una IndexedConsole prende le celle: i buffer della console si liberano
+        void acquireExternalCells() {
+            if (externalCells++ > 0) return;
+            getCurrentSize(externalWidth, externalHeight);
+            externalRowsLost.assign(externalHeight, 0);
+            resizeCells(0, 0);
+            for (auto *rows : {&buffer, &prevBuffer, &baseBuffer, &cacheBuffer}) vector<vector<char32_t>>().swap(*rows);
+            for (auto *rows : {&fgBuffer, &bgBuffer, &prevFgBuffer, &prevBgBuffer, &baseFgBuffer, &baseBgBuffer,
+                               &cacheFgBuffer, &cacheBgBuffer})
+                vector<vector<Color>>().swap(*rows);
+        }
+
+        // L'ultima IndexedConsole se ne va: buffer di nuovo della console, tutto da ridisegnare
+        void releaseExternalCells() {
+            if (--externalCells > 0) return;
+            vector<char>().swap(externalRowsLost);
+            ensureSize();
+            invalidate();
+        }
+
+        // ======================== INPUT PARSING ========================
+        #ifdef OS_LINUX
+            void parseKeySequence(const string &seq) {
+                if(seq.empty()) return;
+                
+                if(seq[0] != '\033') {
+                    char c = seq[0];
+                    if(c >= 32 && c <= 126) keyEvent(c, c, 0);
+                    else if(c == '\n' || c == '\r') keyEvent(KEY_ENTER, KEY_ENTER, 0);
+                    else if(c == '\t') keyEvent(KEY_TAB, KEY_TAB, 0);
+                    else if(c == 127) keyEvent(KEY_BACKSPACE, KEY_BACKSPACE, 0);
+                    else keyQueue.push(c);
+                    return;
+                }
+                
+                if(seq.size() < 3) {
+                    keyEvent(KEY_ESC, KEY_ESC, 0);
+                    return;
+                }
+                
+                if(seq[1] == '[') parseCsiKey(seq);
+            }
+
+            // CSI [codice[:shiftato]] [; modificatori[:evento]] finale. Copre sia le
+            // sequenze classiche (CSI A, CSI 5~) sia il protocollo di kitty, dove i tasti
+            // di testo arrivano come CSI codice u e l'evento e' 1 press, 2 repeat, 3 release
+            void parseCsiKey(const string &seq) {
+                int field[2][2] = {{-1, -1}, {-1, -1}};
+                int f = 0, sub = 0;
+                for(size_t i = 2; i + 1 < seq.size(); i++) {
+                    char c = seq[i];
+                    if(isdigit((unsigned char)c)) {
+                        if(f < 2 && sub < 2) field[f][sub] = max(field[f][sub], 0) * 10 + (c - '0');
+                    }
+                    else if(c == ':') sub++;
+                    else if(c == ';') { f++; sub = 0; }
+                }
+                int mods = max(field[1][0], 1) - 1;
+                int event = field[1][1] > 0 ? field[1][1] : (keyEvents ? 1 : 0);
+
+                int key = KEY_NONE;
+                switch(seq.back()) {
+                    case 'A': key = KEY_UP; break;
+                    case 'B': key = KEY_DOWN; break;
+                    case 'C': key = KEY_RIGHT; break;
+                    case 'D': key = KEY_LEFT; break;
+                    case 'H': key = KEY_HOME; break;
+                    case 'F': key = KEY_END; break;
+                    case '~':
+                        switch(field[0][0]) {
+                            case 1: case 7: key = KEY_HOME; break;
+                            case 2: key = KEY_INSERT; break;
+                            case 3: key = KEY_DELETE; break;
+                            case 4: case 8: key = KEY_END; break;
+                            case 5: key = KEY_PAGEUP; break;
+                            case 6: key = KEY_PAGEDOWN; break;
+                        }
+                        break;
+                    case 'u': {
+                        int code = field[0][0];
+                        if(code == 13) key = KEY_ENTER;
+                        else if(code == 9) key = KEY_TAB;
+                        else if(code == 127) key = KEY_BACKSPACE;
+                        else if(code == 27) key = KEY_ESC;
+                        // Modificatori da soli, tasti non ASCII: niente da riportare
+                        else if(code < 32 || code > 126) return;
+                        else {
+                            // Nella coda cio' che il terminale scriverebbe senza protocollo
+                            int typed = code;
+                            if((mods & 1) && field[0][1] > 0 && field[0][1] < 128) typed = field[0][1];
+                            else if((mods & 1) && code >= 'a' && code <= 'z') typed = code - 32;
+                            if((mods & 4) && isalpha(code)) typed = code & 0x1f;
+                            keyEvent(code, typed, event);
+                            return;
+                        }
+                        break;
+                    }
+                }
+                if(key != KEY_NONE) keyEvent(key, key, event);
+            }
+        #endif
+
+        // Indice nella tabella dei tasti giu'; le lettere maiuscole contano come minuscole
+        static int keyIndex(int key) {
+            if(key == KEY_SPACE) key = ' ';
+            if(key >= 'A' && key <= 'Z') key += 32;
+            if(key >= 0 && key < 128) return key;
+            if(key >= KEY_UP && key <= KEY_DELETE) return 128 + key - KEY_UP;
+            return -1;
+        }
+
+        void clearKeyStates() {
+            for(int i = 0; i < KEY_STATES; i++) {
+                keyDown[i] = false;
+                keyJustPressed[i] = false;
+                keyJustReleased[i] = false;
+            }
+        }
+
+        void releaseKey(int i) {
+            if(!keyDown[i]) return;
+            keyDown[i] = false;
+            keyJustReleased[i] = true;
+        }
+
+        // key va nella tabella, typed nella coda di getKey() (solo press e repeat).
+        // event: 1 press, 2 repeat, 3 release, 0 carattere semplice (press senza release)
+        void keyEvent(int key, int typed, int event) {
+            int i = keyIndex(key);
+            if(event == 3) {
+                if(i >= 0) releaseKey(i);
+                return;
+            }
+            keyQueue.push(typed);
+            if(i >= 0) {
+                if(!keyDown[i]) keyJustPressed[i] = true;
+                keyDown[i] = true;
+                if(event == 0) keyTaps.push_back(i);
+            }
+        }
+
+        #ifdef OS_LINUX
+
+            void parseMouseSequence(const string &seq) {
+                if(seq.size() < 6) return;
+                if(seq[0] != '\033' || seq[1] != '[' || seq[2] != '<') return;
+                
+                int b = 0, x = 0, y = 0;
                 char type;
                 if(sscanf(seq.c_str() + 3, "%d;%d;%d%c", &b, &x, &y, &type) == 4) {
                     mouseX = x - 1; // Convert to 0-based
@@ -369,547 +2170,3883 @@ namespace detail {
                             mouseButtonPressed[button] = !mouseButtonDown[button];
                             mouseButtonDown[button] = true;
                         }
-                    } else if(type == 'm') {
-                        if(!isScroll) {
-                            mouseButtonReleased[button] = mouseButtonDown[button];
-                            mouseButtonDown[button] = false;
-                        } else {
-                            // Mouse wheel release
-                            int scrollBtn = (b & 1) ? 4 : 3;
-                            mouseButtonReleased[scrollBtn] = true;
+                    } else if(type == 'm') {
+                        if(!isScroll) {
+                            mouseButtonReleased[button] = mouseButtonDown[button];
+                            mouseButtonDown[button] = false;
+                        } else {
+                            // Mouse wheel release
+                            int scrollBtn = (b & 1) ? 4 : 3;
+                            mouseButtonReleased[scrollBtn] = true;
+                        }
+                    }
+                }
+            }
+
+            bool isSequenceComplete(const string& seq) {
+                if(seq.empty()) return true;
+                if(seq[0] != '\033') return true;
+                if(seq.size() < 2) return false;
+                
+                // Mouse sequences
+                if(seq.size() >= 3 && seq[1] == '[' && seq[2] == '<') {
+                    return seq.find('M') != string::npos || seq.find('m') != string::npos;
+                }
+                
+                // Risposte DCS (XTVERSION, "P>|") e APC (grafica kitty, "_G"), che finiscono
+                // con ST o BEL. Solo durante un probe: altrimenti ESC P e ESC _ sono Alt+P e
+                // Alt+_ e aspettare un terminatore mangerebbe i tasti successivi.
+                if(probing && (seq[1] == 'P' || seq[1] == '_')) {
+                    const char *prefix = seq[1] == 'P' ? "P>|" : "_G";
+                    size_t len = strlen(prefix), n = seq.size();
+                    if(seq.compare(1, min(n - 1, len), prefix, min(n - 1, len)) != 0) return true;
+                    if(n - 1 < len) return false;
+                    return (n >= 4 && seq[n - 2] == '\033' && seq[n - 1] == '\\') || seq[n - 1] == '\a';
+                }
+
+                // CSI sequences
+                if(seq[1] == '[') {
+                    if(seq.size() >= 3) {
+                        char last = seq.back();
+                        // Sequences ending with letters or ~
+                        return (last >= 'A' && last <= 'Z') || (last >= 'a' && last <= 'z') || last == '~';
+                    }
+                    return false;
+                }
+                
+                return true;
+            }
+
+            // Risposte alle query di probeCapabilities(). Ritorna true se seq era una risposta.
+            bool parseTerminalReply(const string &seq) {
+                if(seq.size() < 3 || seq[0] != '\033') return false;
+
+                // XTVERSION: DCS > | nome(versione) ST
+                if(seq[1] == 'P' && seq.size() > 4 && seq[2] == '>' && seq[3] == '|') {
+                    size_t terminator = seq.back() == '\a' ? 1 : 2;
+                    terminalName = seq.substr(4, seq.size() - 4 - terminator);
+                    return true;
+                }
+                // Grafica kitty: APC G i=31 ; OK ST (o un errore)
+                if(seq[1] == '_' && seq[2] == 'G') {
+                    caps.kittyGraphics = seq.find(";OK") != string::npos;
+                    return true;
+                }
+                if(seq[1] != '[' || seq[2] != '?') return false;
+
+                char last = seq.back();
+                vector<int> params;
+                int value = 0;
+                bool any = false;
+                for(size_t i = 3; i < seq.size() - 1; i++) {
+                    if(isdigit((unsigned char)seq[i])) { value = value * 10 + (seq[i] - '0'); any = true; }
+                    else if(seq[i] == ';') { params.push_back(value); value = 0; any = false; }
+                    else if(seq[i] == '$') break;
+                }
+                if(any) params.push_back(value);
+
+                // DA1: CSI ? 6x ; ... c (arriva per ultima: chiude il probe)
+                if(last == 'c') {
+                    for(size_t i = 1; i < params.size(); i++)
+                        if(params[i] == 4) caps.sixel = true;
+                    probeReplied = true;
+                    return true;
+                }
+                // DECRPM: CSI ? modo ; stato $ y
+                if(last == 'y' && seq.find('$') != string::npos) {
+                    if(params.size() == 2 && params[0] == 2026)
+                        caps.syncOutput = (params[1] == 1 || params[1] == 2);
+                    return true;
+                }
+                // Flag correnti del protocollo tastiera di kitty: CSI ? flags u
+                if(last == 'u') {
+                    caps.kittyKeyboard = true;
+                    return true;
+                }
+                return false;
+            }
+        #endif
+
+    public:
+        static Console& get() {
+            static Console instance;
+            return instance;
+        }
+
+        void cleanup() {
+            resetTerminal();
+            exit(0);
+        }
+
+        // ======================== INPUT UPDATE ========================
+        void updateInput() {
+            PWETTY_ZONE("updateInput");
+            for(int i = 0; i < 8; i++) {
+                mouseButtonPressed[i] = false;
+                mouseButtonReleased[i] = false;
+            }
+            for(int i = 0; i < KEY_STATES; i++) {
+                keyJustPressed[i] = false;
+                keyJustReleased[i] = false;
+            }
+            for(int i : keyTaps)
+                releaseKey(i);
+            keyTaps.clear();
+
+            #ifdef OS_LINUX
+                char buf[256];
+                ssize_t n;
+                
+                while((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+                    for(ssize_t i = 0; i < n; i++) {
+                        incompleteSequence += buf[i];
+                        
+                        if(isSequenceComplete(incompleteSequence)) {
+                            if(parseTerminalReply(incompleteSequence)) {
+                                // risposta a una query, non un tasto
+                            } else if(incompleteSequence.size() > 3 && incompleteSequence[2] == '<') {
+                                parseMouseSequence(incompleteSequence);
+                            } else {
+                                parseKeySequence(incompleteSequence);
+                            }
+                            incompleteSequence.clear();
+                        }
+                    }
+
+                    // Prevent infinite loop if we keep getting data
+                    if(n < (ssize_t)sizeof(buf)) break;
+                }
+            #endif
+
+            #ifdef OS_WINDOWS
+                DWORD numEvents = 0;
+                GetNumberOfConsoleInputEvents(hStdin, &numEvents);
+                if(numEvents == 0) return;
+
+                INPUT_RECORD irInBuf[128];
+                DWORD numRead = 0;
+                if(!ReadConsoleInput(hStdin, irInBuf, min(numEvents, (DWORD)128), &numRead)) return;
+
+                for(DWORD i = 0; i < numRead; i++) {
+                    if(irInBuf[i].EventType == KEY_EVENT) {
+                        KEY_EVENT_RECORD ker = irInBuf[i].Event.KeyEvent;
+                        int key = KEY_NONE;
+
+                        if(ker.uChar.AsciiChar != 0) {
+                            char c = ker.uChar.AsciiChar;
+                            if(c == '\r') key = KEY_ENTER;
+                            else if(c == '\t') key = KEY_TAB;
+                            else if(c == '\b') key = KEY_BACKSPACE;
+                            else if(c == ' ') key = KEY_SPACE;
+                            else if(c >= 32 && c <= 126) key = c;
+                        } else {
+                            switch(ker.wVirtualKeyCode) {
+                                case VK_UP: key = KEY_UP; break;
+                                case VK_DOWN: key = KEY_DOWN; break;
+                                case VK_LEFT: key = KEY_LEFT; break;
+                                case VK_RIGHT: key = KEY_RIGHT; break;
+                                case VK_HOME: key = KEY_HOME; break;
+                                case VK_END: key = KEY_END; break;
+                                case VK_PRIOR: key = KEY_PAGEUP; break;
+                                case VK_NEXT: key = KEY_PAGEDOWN; break;
+                                case VK_INSERT: key = KEY_INSERT; break;
+                                case VK_DELETE: key = KEY_DELETE; break;
+                                case VK_ESCAPE: key = KEY_ESC; break;
+                            }
+                        }
+                        // La console Windows da' gia' press e release separati
+                        if(key != KEY_NONE) keyEvent(key, key, ker.bKeyDown ? 1 : 3);
+                    } else if(irInBuf[i].EventType == MOUSE_EVENT) {
+                        MOUSE_EVENT_RECORD mer = irInBuf[i].Event.MouseEvent;
+                        mouseX = mer.dwMousePosition.X;
+                        mouseY = mer.dwMousePosition.Y;
+
+                        bool currentButtonState[8] = {false};
+                        currentButtonState[0] = (mer.dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED) != 0;
+                        currentButtonState[1] = (mer.dwButtonState & RIGHTMOST_BUTTON_PRESSED) != 0;
+                        currentButtonState[2] = (mer.dwButtonState & FROM_LEFT_2ND_BUTTON_PRESSED) != 0;
+
+                        for(int b = 0; b < 3; b++) {
+                            if(currentButtonState[b] && !prevMouseButtonState[b]) {
+                                mouseButtonPressed[b] = true;
+                                mouseButtonDown[b] = true;
+                            } else if(!currentButtonState[b] && prevMouseButtonState[b]) {
+                                mouseButtonReleased[b] = true;
+                                mouseButtonDown[b] = false;
+                            } else if(currentButtonState[b]) {
+                                mouseButtonDown[b] = true;
+                            }
+                            prevMouseButtonState[b] = currentButtonState[b];
+                        }
+
+                        if(mer.dwEventFlags & MOUSE_WHEELED) {
+                            int delta = (short)HIWORD(mer.dwButtonState);
+                            int scrollBtn = (delta > 0) ? 3 : 4;
+                            mouseButtonPressed[scrollBtn] = true;
+                            mouseButtonReleased[scrollBtn] = true;
+                        }
+                    }
+                }
+            #endif
+        }
+
+        // ======================== INPUT ACCESSORS ========================
+        bool isKeyPressed() const { return !keyQueue.empty(); }
+        int popKey() {
+            if(keyQueue.empty()) return KEY_NONE;
+            int k = keyQueue.front();
+            keyQueue.pop();
+            return k;
+        }
+
+        int getMouseX() const { return (pixelMode?mouseX/2:mouseX); }
+        int getMouseY() const { return mouseY; }
+        bool isMouseButtonDown(int b) const { return b >= 0 && b < 8 ? mouseButtonDown[b] : false; }
+        bool isMouseButtonPressed(int b) const { return b >= 0 && b < 8 ? mouseButtonPressed[b] : false; }
+        bool isMouseButtonReleased(int b) const { return b >= 0 && b < 8 ? mouseButtonReleased[b] : false; }
+
+        // Stato dei tasti per i giochi: con gli eventi attivi un tasto resta giu' da
+        // quando viene premuto a quando viene rilasciato, senza aspettare l'autorepeat.
+        // Senza, e' giu' solo nel frame in cui ne arriva il carattere e rilasciato nel dopo.
+        bool isKeyDown(int key) const { int i = keyIndex(key); return i >= 0 && keyDown[i]; }
+        bool isKeyJustPressed(int key) const { int i = keyIndex(key); return i >= 0 && keyJustPressed[i]; }
+        bool isKeyJustReleased(int key) const { int i = keyIndex(key); return i >= 0 && keyJustReleased[i]; }
+        bool keyEventsEnabled() const { return keyEvents; }
+
+        // Chiede al terminale press, repeat e release di ogni tasto (protocollo tastiera
+        // di kitty: disambigua, tipi di evento, tasti alternativi, tutti i tasti come
+        // sequenze). False se il terminale non lo supporta; su Windows sempre attivo.
+        bool enableKeyEvents(bool on = true) {
+            #ifdef OS_LINUX
+                if(on == keyEvents) return keyEvents;
+                if(on && !caps.kittyKeyboard) return false;
+                const char *seq = on ? "\033[>15u" : "\033[<u";
+                detail::writeAll(STDOUT_FILENO, seq, strlen(seq));
+                keyEvents = on;
+                clearKeyStates();
+                keyTaps.clear();
+            #endif
+            return keyEvents;
+        }
+
+        // ======================== RENDERING ========================
+        void clear(Color bg = DEFAULT_BG) {
+            ensureSize();
+            if (activeLayer) {
+                activeLayer->clear(bg);
+                return;
+            }
+            if (!layers.empty()) {
+                // Si ricompongono solo le zone coperte dai layer
+                for (auto &row : baseBuffer)
+                    fill(row.begin(), row.end(), U' ');
+                for (auto &row : baseFgBuffer)
+                    fill(row.begin(), row.end(), DEFAULT_FG);
+                for (auto &row : baseBgBuffer)
+                    fill(row.begin(), row.end(), bg);
+                markBaseDirty({0, 0, width, height});
+            }
+            for (auto &row : buffer)
+                fill(row.begin(), row.end(), U' ');
+            for (auto &row : fgBuffer)
+                fill(row.begin(), row.end(), DEFAULT_FG);
+            for (auto &row : bgBuffer)
+                fill(row.begin(), row.end(), bg);
+
+            // Tutte le tile intere hanno lo stesso hash: si calcola una volta sola
+            uint64_t full = 0;
+            for (int y = 0; y < detail::TILE_H; y++)
+                for (int x = 0; x < detail::TILE_W; x++)
+                    full ^= detail::cellHash(x, y, U' ', DEFAULT_FG, bg);
+            for (int t = 0; t < tilesX * tilesY; t++) {
+                bool whole = (t % tilesX + 1) * detail::TILE_W <= width && (t / tilesX + 1) * detail::TILE_H <= height;
+                tileHash[t] = whole ? full : computeTileHash(t);
+                tileStale[t] = 0;
+            }
+        }
+
+        // ======================== RECORDING / OUTPUT ========================
+        bool startRecording(const string &path) {
+            ensureSize();
+            recorder = make_unique<detail::Recorder>(path, width, height);
+            if (!recorder->isOpen()) {
+                recorder.reset();
+                return false;
+            }
+            // Il primo frame registrato deve essere completo
+            invalidate();
+            return true;
+        }
+
+        void stopRecording() { recorder.reset(); }
+        bool isRecording() const { return recorder != nullptr; }
+        size_t recordingDroppedFrames() const { return recorder ? recorder->droppedFrames() : 0; }
+
+        #ifdef OS_LINUX
+            // Manda i frame su un altro fd (pipe, file, socket) invece che su stdout
+            void setOutputFd(int fd) {
+                bool nonBlocking = nonBlockingOutput;
+                setNonBlockingOutput(false);
+                outputFd = fd;
+                setNonBlockingOutput(nonBlocking);
+                invalidate();
+            }
+            int getOutputFd() const { return outputFd; }
+
+            // Con l'output non bloccante render() non aspetta mai il terminale: quello che
+            // non esce subito resta in coda, e se il frame dopo e' pronto prima che la coda
+            // si svuoti le righe non ancora inviate vengono scartate e ridisegnate in seguito
+            void setNonBlockingOutput(bool enabled) {
+                if (enabled == nonBlockingOutput) return;
+                if (enabled) {
+                    savedOutputFlags = fcntl(outputFd, F_GETFL);
+                    if (savedOutputFlags >= 0)
+                        fcntl(outputFd, F_SETFL, savedOutputFlags | O_NONBLOCK);
+                } else {
+                    flushOutput(true);
+                    // stdin e stdout di un terminale condividono i flag: si rimettono com'erano
+                    if (savedOutputFlags >= 0)
+                        fcntl(outputFd, F_SETFL, savedOutputFlags);
+                }
+                nonBlockingOutput = enabled;
+            }
+            bool isNonBlockingOutput() const { return nonBlockingOutput; }
+
+            // Manda i byte in coda; con wait aspetta che il terminale li prenda tutti.
+            // Ritorna true se la coda e' vuota.
+            bool flushOutput(bool wait = false) {
+                while (!pendingOutput.empty()) {
+                    ssize_t n = ::write(outputFd, pendingOutput.data(), pendingOutput.size());
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno != EAGAIN) { pendingOutput.clear(); break; }
+                        if (!wait) break;
+                        detail::waitWritable(outputFd);
+                        continue;
+                    }
+                    pendingOutput.erase(0, n);
+                    stats.bytesWritten += n;
+                }
+                stats.bytesPending = pendingOutput.size();
+                return pendingOutput.empty();
+            }
+        #endif
+
+        // ======================== SHARING ========================
+        #ifdef OS_LINUX
+            // Apre un socket unix su path: ogni viewer che si collega (runViewer in un
+            // altro terminale) vede lo schermo a ogni render(). Il frame si compone una
+            // volta sola, solo la codifica e' per viewer.
+            bool startSharing(const string &path) {
+                stopSharing();
+                sockaddr_un addr{};
+                addr.sun_family = AF_UNIX;
+                if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+                memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+                // Un socket rimasto da un'esecuzione precedente, ma mai un file vero
+                struct stat st;
+                if (stat(path.c_str(), &st) == 0) {
+                    if (!S_ISSOCK(st.st_mode)) return false;
+                    unlink(path.c_str());
+                }
+
+                int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0) return false;
+                if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+                    close(fd);
+                    return false;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                shareFd = fd;
+                sharePath = path;
+                // I viewer si codificano in parallelo
+                detail::GlyphCache::get().warmBmp();
+                return true;
+            }
+
+            void stopSharing() {
+                viewers.clear();
+                if (shareFd < 0) return;
+                close(shareFd);
+                unlink(sharePath.c_str());
+                shareFd = -1;
+                sharePath.clear();
+            }
+
+            bool isSharing() const { return shareFd >= 0; }
+
+            int viewerCount() const {
+                int n = 0;
+                for (const auto &v : viewers) n += v->ready;
+                return n;
+            }
+
+            // Accetta i nuovi viewer, legge i loro messaggi e manda a ognuno il frame
+            // appena composto. Un viewer che non ha ancora preso il frame precedente
+            // salta questo: il suo diff resta rispetto a quello che ha davvero.
+            void serveViewers() {
+                if (shareFd < 0) return;
+                PWETTY_ZONE("serveViewers");
+                while (true) {
+                    int fd = accept(shareFd, nullptr, nullptr);
+                    if (fd < 0) break;
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    viewers.push_back(make_unique<detail::Viewer>());
+                    viewers.back()->fd = fd;
+                }
+
+                viewersDue.clear();
+                for (size_t i = 0; i < viewers.size();) {
+                    detail::Viewer &v = *viewers[i];
+                    if (!readViewer(v) || !flushViewer(v)) {
+                        viewers.erase(viewers.begin() + i);
+                        continue;
+                    }
+                    i++;
+                    if (!v.ready) continue;
+                    if (!v.pending.empty()) { v.framesDropped++; continue; }
+                    viewersDue.push_back(&v);
+                }
+
+                workers().run((int)viewersDue.size(), [&](int i) { encodeForViewer(*viewersDue[i]); });
+
+                for (detail::Viewer *v : viewersDue) {
+                    v->pending.swap(v->frame);
+                    flushViewer(*v);
+                }
+            }
+
+            // Legge le righe di controllo del viewer; false se si e' scollegato
+            bool readViewer(detail::Viewer &v) {
+                char chunk[256];
+                while (true) {
+                    ssize_t n = recv(v.fd, chunk, sizeof(chunk), 0);
+                    if (n == 0) return false;
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        return false;
+                    }
+                    v.input.append(chunk, n);
+                }
+                size_t nl;
+                while ((nl = v.input.find('\n')) != string::npos) {
+                    if (!v.handleLine(v.input.substr(0, nl))) return false;
+                    v.input.erase(0, nl + 1);
+                }
+                return v.input.size() < 256;
+            }
+
+            // Manda quanto possibile della coda del viewer senza aspettarlo; false se
+            // la connessione e' chiusa
+            bool flushViewer(detail::Viewer &v) {
+                size_t sent = 0;
+                while (sent < v.pending.size()) {
+                    ssize_t n = send(v.fd, v.pending.data() + sent, v.pending.size() - sent, MSG_NOSIGNAL);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        return false;
+                    }
+                    sent += n;
+                }
+                v.pending.erase(0, sent);
+                return true;
+            }
+
+            // Codifica il frame per un viewer contro quello che il suo terminale mostra.
+            // Non tocca lo stato del Console: i viewer si codificano in parallelo.
+            void encodeForViewer(detail::Viewer &v) const {
+                if (v.consoleWidth != width || v.consoleHeight != height)
+                    v.reset(width, height);
+                int rows = min(height, v.height), cols = min(width, v.width);
+                // Oltre il bordo del Console il viewer resta vuoto: niente EL che lo colori
+                Capabilities rowCaps = v.caps;
+                rowCaps.ech = v.width <= width;
+
+                v.frame.clear();
+                if (v.caps.syncOutput) v.frame += "\033[?2026h";
+                size_t head = v.frame.size();
+                if (v.clearScreen) {
+                    v.frame += "\033[0m\033[2J";
+                    v.clearScreen = false;
+                }
+
+                detail::EncoderState st;
+                for (int y = 0; y < rows; ++y) {
+                    if (v.depth == ColorDepth::Color256)
+                        encodeRowAgainst<Color256Model>(y, cols, v.prevBuffer[y], v.prevFgBuffer[y],
+                                                        v.prevBgBuffer[y], rowCaps, v.frame, st);
+                    else
+                        encodeRowAgainst<TrueColorModel>(y, cols, v.prevBuffer[y], v.prevFgBuffer[y],
+                                                         v.prevBgBuffer[y], rowCaps, v.frame, st);
+                    copy_n(buffer[y].begin(), cols, v.prevBuffer[y].begin());
+                    copy_n(fgBuffer[y].begin(), cols, v.prevFgBuffer[y].begin());
+                    copy_n(bgBuffer[y].begin(), cols, v.prevBgBuffer[y].begin());
+                }
+
+                if (v.frame.size() == head) {
+                    v.frame.clear();
+                    return;
+                }
+                v.frame += RESET_COLOR;
+                if (v.caps.syncOutput) v.frame += "\033[?2026l";
+            }
+        #endif
+
+        const OutputStats &getOutputStats() const { return stats; }
+        void resetOutputStats() {
+            stats = OutputStats();
+            #ifdef OS_LINUX
+                stats.bytesPending = pendingOutput.size();
+            #endif
+        }
+
+        // ======================== ENCODING ========================
+        static Capabilities guessCapabilities() {
+            Capabilities c;
+            // REP non e' supportato ovunque: solo i terminali noti
+            const char *term = getenv("TERM");
+            const char *program = getenv("TERM_PROGRAM");
+            string t = term ? term : "", p = program ? program : "";
+            c.rep = t.find("kitty") != string::npos || t.find("foot") != string::npos ||
+                    t.find("alacritty") != string::npos || p == "WezTerm" ||
+                    getenv("XTERM_VERSION") != nullptr;
+            c.ech = t != "dumb";
+            return c;
+        }
+
+        #ifdef OS_LINUX
+            // ~/.cache/pwetty/caps-<TERM_PROGRAM>, un file per tipo di terminale
+            static string capabilityCachePath(bool createDir = false) {
+                const char *xdg = getenv("XDG_CACHE_HOME");
+                const char *home = getenv("HOME");
+                string dir;
+                if (xdg && *xdg) dir = xdg;
+                else if (home && *home) dir = string(home) + "/.cache";
+                else return "";
+
+                const char *program = getenv("TERM_PROGRAM");
+                const char *term = getenv("TERM");
+                string key = (program && *program) ? program : (term && *term) ? term : "unknown";
+                for (char &c : key)
+                    if (!isalnum((unsigned char)c) && c != '-' && c != '.') c = '_';
+
+                if (createDir) {
+                    mkdir(dir.c_str(), 0755);
+                    mkdir((dir + "/pwetty").c_str(), 0755);
+                }
+                return dir + "/pwetty/caps-" + key;
+            }
+
+            bool loadCapabilityCache() {
+                string path = capabilityCachePath();
+                FILE *file = path.empty() ? nullptr : fopen(path.c_str(), "r");
+                if (!file) return false;
+
+                char line[256];
+                bool valid = false;
+                while (fgets(line, sizeof(line), file)) {
+                    char key[64];
+                    int value;
+                    if (strncmp(line, "pwetty-caps 1", 13) == 0) { valid = true; continue; }
+                    if (sscanf(line, "%63[^=]=%d", key, &value) != 2) continue;
+                    string k = key;
+                    if (k == "rep") caps.rep = value;
+                    else if (k == "ech") caps.ech = value;
+                    else if (k == "truecolor") caps.truecolor = value;
+                    else if (k == "sync") caps.syncOutput = value;
+                    else if (k == "kitty") caps.kittyKeyboard = value;
+                    else if (k == "sixel") caps.sixel = value;
+                    else if (k == "kittygfx") caps.kittyGraphics = value;
+                }
+                fclose(file);
+                return valid;
+            }
+
+            void saveCapabilityCache() const {
+                string path = capabilityCachePath(true);
+                FILE *file = path.empty() ? nullptr : fopen(path.c_str(), "w");
+                if (!file) return;
+                fprintf(file, "pwetty-caps 1\nrep=%d\nech=%d\ntruecolor=%d\nsync=%d\nkitty=%d\nsixel=%d\nkittygfx=%d\n",
+                        caps.rep, caps.ech, caps.truecolor, caps.syncOutput, caps.kittyKeyboard, caps.sixel,
+                        caps.kittyGraphics);
+                fclose(file);
+            }
+
+            // Interroga il terminale (XTVERSION, DECRQM 2026, tastiera e grafica kitty, DA1) e salva
+            // il risultato in cache. DA1 e' l'ultima: tutti i terminali rispondono, quindi
+            // quando arriva le altre risposte sono gia' state lette.
+            void probeCapabilities(int timeoutMs = 150) {
+                if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) return;
+
+                probeReplied = false;
+                terminalName.clear();
+                caps.syncOutput = false;
+                caps.kittyKeyboard = false;
+                caps.sixel = false;
+                caps.kittyGraphics = false;
+
+                const char *query = "\033[>0q\033[?2026$p\033[?u\033_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\033\\\033[c";
+                detail::writeAll(STDOUT_FILENO, query, strlen(query));
+
+                auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+                probing = true;
+                while (!probeReplied) {
+                    auto left = chrono::duration_cast<chrono::microseconds>(deadline - chrono::steady_clock::now()).count();
+                    if (left <= 0) break;
+                    fd_set fds;
+                    FD_ZERO(&fds);
+                    FD_SET(STDIN_FILENO, &fds);
+                    struct timeval tv = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+                    if (select(STDIN_FILENO + 1, &fds, nullptr, nullptr, &tv) <= 0) break;
+                    updateInput();
+                }
+                probing = false;
+
+                // Nessuna risposta (pipe, terminale muto): resta con le ipotesi da TERM
+                if (!probeReplied) return;
+
+                string name = terminalName;
+                const char *colorterm = getenv("COLORTERM");
+                bool knownModern = name.find("kitty") != string::npos || name.find("WezTerm") != string::npos ||
+                                   name.find("foot") != string::npos || name.find("XTerm") != string::npos ||
+                                   name.find("iTerm2") != string::npos || name.find("contour") != string::npos;
+                caps.rep = caps.rep || knownModern;
+                caps.truecolor = knownModern || (colorterm && (strcmp(colorterm, "truecolor") == 0 ||
+                                                              strcmp(colorterm, "24bit") == 0));
+                saveCapabilityCache();
+            }
+
+            const string &getTerminalName() const { return terminalName; }
+        #endif
+
+        void setCapabilities(const Capabilities &c) {
+            caps = c;
+            dropRowCache();
+        }
+        const Capabilities &getCapabilities() const { return caps; }
+
+        inline bool cellChanged(int x, int y) const {
+            return buffer[y][x] != prevBuffer[y][x] ||
+                   fgBuffer[y][x] != prevFgBuffer[y][x] ||
+                   bgBuffer[y][x] != prevBgBuffer[y][x];
+        }
+
+        // Numero di thread per codificare il frame (0 = tutti i core). Con piu' thread
+        // le righe si dividono in bande codificate in parallelo e poi unite in ordine.
+        void setEncodeThreads(int threads) {
+            if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency());
+            encodeThreads = threads;
+            if (threads > 1) detail::GlyphCache::get().warmBmp();
+        }
+        int getEncodeThreads() const { return encodeThreads; }
+
+        detail::WorkerPool &workers() {
+            if (!pool) pool = make_unique<detail::WorkerPool>(max(1, (int)thread::hardware_concurrency()));
+            return *pool;
+        }
+
+        template <class Model>
+        void encodeFrame() {
+            PWETTY_ZONE("encodeFrame");
+            beginFrameParts();
+            retireGraphics();
+            refreshTiles();
+
+            // Bande troppo piccole costano piu' in sincronizzazione che in encoding
+            const int minRowsPerBand = 4;
+            int bands = min(encodeThreads, height / minRowsPerBand);
+            if (bands > 1) {
+                workers().run(bands, [&](int band) {
+                    encodeRows<Model>(height * band / bands, height * (band + 1) / bands);
+                });
+            } else {
+                encodeRows<Model>(0, height);
+            }
+
+            for (int y = 0; y < height; ++y) {
+                const string &part = rowInvalid[y] ? rowCache[y] : rowOutput[y];
+                if (part.empty()) continue;
+                frameParts.push_back(&part);
+                framePartRows.push_back(y);
+            }
+            fill(rowInvalid.begin(), rowInvalid.end(), 0);
+
+            // Le immagini dopo le celle: il testo sotto di loro e' gia' stato scritto
+            emitGraphics();
+            if (!frameGraphics.empty()) {
+                frameParts.push_back(&frameGraphics);
+                framePartRows.push_back(-2);
+            }
+
+            endFrameParts();
+        }
+
+        void beginFrameParts() {
+            frameHead.clear();
+            frameTail.clear();
+            frameParts.clear();
+            framePartRows.clear();
+            if (caps.syncOutput) frameHead += "\033[?2026h";
+            frameParts.push_back(&frameHead);
+            framePartRows.push_back(-1);
+        }
+
+        void endFrameParts() {
+            frameTail += RESET_COLOR;
+            if (caps.syncOutput) frameTail += "\033[?2026l";
+            frameParts.push_back(&frameTail);
+            framePartRows.push_back(-1);
+        }
+
+        // Frame gia' codificato da una IndexedConsole, una stringa per riga: parte come
+        // quelli di render() (registrazione, output non bloccante, statistiche). Le righe
+        // scartate finiscono in externalRowsLost.
+        void presentExternal(const vector<string> &rows) {
+            beginFrameParts();
+            for (int y = 0; y < (int)rows.size(); y++) {
+                if (rows[y].empty()) continue;
+                frameParts.push_back(&rows[y]);
+                framePartRows.push_back(y);
+            }
+            endFrameParts();
+            present();
+        }
+
+        // Ogni gruppo di righe parte senza sapere dove sono cursore e colori: la prima
+        // cella cambiata li reimposta, quindi i gruppi si possono codificare in parallelo
+        // Si guardano solo le tile con l'hash cambiato; dentro, ogni tratto di riga passa
+        // prima da un memcmp (vettorizzato) e solo se diverso cella per cella. Il costo
+        // segue quanto e' cambiato, non la dimensione dello schermo.
+        template <class Model>
+        void encodeRows(int y1, int y2) {
+            PWETTY_ZONE("encodeRows");
+            detail::EncoderState st;
+            for (int y = y1; y < y2; ++y) {
+                if (rowInvalid[y]) {
+                    encodeFullRow<Model>(y);
+                    st = detail::EncoderState();
+                    rememberSpan(y, 0, width);
+                    continue;
+                }
+                rowOutput[y].clear();
+                const char *changed = &tileChanged[(y / detail::TILE_H) * tilesX];
+                for (int tx = 0; tx < tilesX;) {
+                    if (!changed[tx]) { tx++; continue; }
+                    int tx2 = tx + 1;
+                    while (tx2 < tilesX && changed[tx2]) tx2++;
+                    int x1 = tx * detail::TILE_W, x2 = min(tx2 * detail::TILE_W, width);
+                    tx = tx2;
+                    if (spanUnchanged(y, x1, x2)) continue;
+                    encodeRowAgainst<Model>(y, width, prevBuffer[y], prevFgBuffer[y], prevBgBuffer[y],
+                                            caps, rowOutput[y], st, x1, x2);
+                    rememberSpan(y, x1, x2);
+                }
+            }
+        }
+
+        bool spanUnchanged(int y, int x1, int x2) const {
+            size_t n = x2 - x1;
+            return memcmp(&buffer[y][x1], &prevBuffer[y][x1], n * sizeof(char32_t)) == 0 &&
+                   memcmp(&fgBuffer[y][x1], &prevFgBuffer[y][x1], n * sizeof(Color)) == 0 &&
+                   memcmp(&bgBuffer[y][x1], &prevBgBuffer[y][x1], n * sizeof(Color)) == 0;
+        }
+
+        // Da qui il terminale mostra le celle [x1, x2) della riga y
+        void rememberSpan(int y, int x1, int x2) {
+            copy(buffer[y].begin() + x1, buffer[y].begin() + x2, prevBuffer[y].begin() + x1);
+            copy(fgBuffer[y].begin() + x1, fgBuffer[y].begin() + x2, prevFgBuffer[y].begin() + x1);
+            copy(bgBuffer[y].begin() + x1, bgBuffer[y].begin() + x2, prevBgBuffer[y].begin() + x1);
+        }
+
+        // Codifica autonoma (cursore e colori da zero) di una riga intera, riusabile
+        template <class Model>
+        void encodeFullRow(int y) {
+            if (rowCacheValid[y] && cacheBuffer[y] == buffer[y] &&
+                cacheFgBuffer[y] == fgBuffer[y] && cacheBgBuffer[y] == bgBuffer[y])
+                return;
+            rowCache[y].clear();
+            detail::EncoderState st;
+            encodeRow<Model>(y, rowCache[y], st);
+            cacheBuffer[y] = buffer[y];
+            cacheFgBuffer[y] = fgBuffer[y];
+            cacheBgBuffer[y] = bgBuffer[y];
+            rowCacheValid[y] = 1;
+        }
+
+        // Le codifiche in cache valgono per un solo modello colore e set di capacita'
+        void dropRowCache() { fill(rowCacheValid.begin(), rowCacheValid.end(), 0); }
+
+        // Codifica le celle cambiate della riga y; le sequenze di celle uguali diventano un'unica run
+        template <class Model>
+        void encodeRow(int y, string &out, detail::EncoderState &st) {
+            encodeRowAgainst<Model>(y, width, prevBuffer[y], prevFgBuffer[y], prevBgBuffer[y], caps, out, st);
+        }
+
+        // Come encodeRow, ma confrontando con quello che mostra un altro terminale (un
+        // viewer) largo rowWidth <= width: le colonne oltre non vengono inviate
+        template <class Model>
+        void encodeRowAgainst(int y, int rowWidth, const vector<char32_t> &prev, const vector<Color> &prevFg,
+                              const vector<Color> &prevBg, const Capabilities &rowCaps,
+                              string &out, detail::EncoderState &st, int xBegin = 0, int xEnd = INT32_MAX) const {
+            detail::GlyphCache &glyphs = detail::GlyphCache::get();
+            const vector<char32_t> &row = buffer[y];
+            const vector<Color> &fgRow = fgBuffer[y], &bgRow = bgBuffer[y];
+            auto changed = [&](int x) {
+                return row[x] != prev[x] || Model::reduce(fgRow[x]) != Model::reduce(prevFg[x]) ||
+                       Model::reduce(bgRow[x]) != Model::reduce(prevBg[x]);
+            };
+
+            int x = xBegin, end = min(xEnd, rowWidth);
+            while (x < end) {
+                char32_t c = row[x];
+                if (c == WIDE_TAIL || !changed(x)) { x++; continue; }
+
+                Color fg = Model::reduce(fgRow[x]), bg = Model::reduce(bgRow[x]);
+                detail::moveCursor(out, st, x, y);
+                detail::setColors<Model>(out, st, fg, bg);
+
+                if (x + 1 < width && row[x + 1] == WIDE_TAIL) {
+                    if (x + 1 < rowWidth) {
+                        const detail::GlyphBytes &glyph = glyphs.bytes(c);
+                        out.append(glyph.bytes, glyph.len);
+                        st.cursorX = (x + 2 >= rowWidth) ? -1 : x + 2;
+                    } else {
+                        // Tagliato dal bordo del terminale: al suo posto uno spazio
+                        detail::emitRun(out, st, rowCaps, glyphs.bytes(U' '), true, 1, rowWidth);
+                    }
+                    x += 2;
+                    continue;
+                }
+
+                int run = 1;
+                while (x + run < end && row[x + run] == c && Model::reduce(fgRow[x + run]) == fg &&
+                       Model::reduce(bgRow[x + run]) == bg && changed(x + run))
+                    run++;
+
+                detail::emitRun(out, st, rowCaps, glyphs.bytes(c), c == U' ', run, rowWidth);
+                x += run;
+            }
+        }
+
+        // Il prossimo render() ridisegna tutte le celle
+        void invalidate() {
+            fill(externalRowsLost.begin(), externalRowsLost.end(), 1);
+            for (auto &row : prevBuffer)
+                fill(row.begin(), row.end(), U'\0');
+            fill(rowInvalid.begin(), rowInvalid.end(), 1);
+            forgetTiles(0, 0, width, height);
+            graphicsLost = true;
+        }
+
+        // Il contenuto della riga y sul terminale non e' noto: la si ridisegna per intero
+        void forgetRow(int y) {
+            if (externalCells) {
+                if (y < (int)externalRowsLost.size()) externalRowsLost[y] = 1;
+                return;
+            }
+            fill(prevBuffer[y].begin(), prevBuffer[y].end(), U'\0');
+            rowInvalid[y] = 1;
+            forgetTiles(0, y, width, y + 1);
+        }
+
+        void resetTerminal() {
+            #ifdef OS_LINUX
+                // Una sequenza lasciata a meta' nella coda rovinerebbe il reset
+                flushOutput(true);
+                printf("\033[0m");
+                printf("\033[?25h");
+                printf("\033[2J\033[H"); // Clear screen and move cursor to top
+                fflush(stdout);
+            #else
+                system("cls");
+            #endif
+        }
+
+        void render() {
+            PWETTY_ZONE("render");
+            bool palette = colorDepth == ColorDepth::Color256;
+            if (qualityLevel >= 2 || (qualityLevel == 1 && palette))
+                buildFrame<Reduced256Model>();
+            else if (qualityLevel == 1)
+                buildFrame<Quantized4Model>();
+            else if (palette)
+                buildFrame<Color256Model>();
+            else
+                buildFrame<TrueColorModel>();
+            present();
+        }
+
+        // Compone e codifica il frame in frameParts; da qui in poi il terminale e'
+        // considerato aggiornato
+        template <class Model>
+        void buildFrame() {
+            ensureSize();
+            composite();
+            encodeFrame<Model>();
+            #ifdef OS_LINUX
+                serveViewers();
+            #endif
+        }
+
+        void present() {
+            PWETTY_ZONE("present");
+            auto start = chrono::steady_clock::now();
+
+            #ifdef OS_LINUX
+                if (nonBlockingOutput) {
+                    presentNonBlocking();
+                    // La scrittura non aspetta: il segnale e' il frame rimasto in coda
+                    if (adaptiveQuality) adaptQuality(0, !pendingOutput.empty());
+                    return;
+                }
+                // Su Linux usa writev diretto per evitare problemi di buffering.
+                // Solo le righe cambiate, tutto il frame in una chiamata (o poche).
+                ssize_t sent = detail::sendParts(outputFd, frameParts, iovScratch);
+                if (sent > 0) stats.bytesWritten += sent;
+                // Nella registrazione solo quello che il terminale ha ricevuto
+                if (recorder && sent >= 0) recorder->frame(frameParts);
+            #else
+                for (const string *part : frameParts) {
+                    cout << *part;
+                    stats.bytesWritten += part->size();
+                }
+                cout << flush;
+                if (recorder) recorder->frame(frameParts);
+            #endif
+            stats.framesPresented++;
+            if (adaptiveQuality)
+                adaptQuality(chrono::duration<double>(chrono::steady_clock::now() - start).count(), false);
+        }
+
+        // Quanto del tempo di un frame se ne va a scrivere sul terminale. Oltre il 60%
+        // la qualita' scende di un livello (al massimo uno ogni 8 frame), sotto il 15%
+        // per qualche secondo risale. Una risalita subito smentita raddoppia l'attesa
+        // per la prossima, cosi' un collegamento al limite non oscilla a ogni frame.
+        void adaptQuality(double seconds, bool backlog) {
+            framesSinceQualityChange++;
+            if (skipLoadSample) {
+                // Il frame dopo una risalita ridisegna tutto: non dice niente sul collegamento
+                skipLoadSample = false;
+                return;
+            }
+            double sample = backlog ? 1.5 : seconds * qualityTargetFps;
+            outputLoad = outputLoad * 0.8 + sample * 0.2;
+            if (outputLoad > 0.6 && qualityLevel < 3 && framesSinceQualityChange >= 8) {
+                if (lastQualityChangeUp && framesSinceQualityChange < qualityUpWait * 2)
+                    qualityUpWait = min(qualityUpWait * 2, qualityTargetFps * 60);
+                changeQuality(qualityLevel + 1);
+            } else if (outputLoad < 0.15 && qualityLevel > 0 && framesSinceQualityChange >= qualityUpWait) {
+                changeQuality(qualityLevel - 1);
+            }
+        }
+
+        void changeQuality(int level) {
+            bool up = level < qualityLevel;
+            qualityLevel = level;
+            framesSinceQualityChange = 0;
+            lastQualityChangeUp = up;
+            if (level == 0) qualityUpWait = qualityTargetFps * 2;
+            dropRowCache();
+            if (up) {
+                // Il terminale mostra ancora i colori ridotti: si ridisegnano tutte le
+                // righe (le immagini restano dove sono)
+                for (int y = 0; y < height; y++) forgetRow(y);
+                skipLoadSample = true;
+            }
+        }
+
+        // Con enabled la qualita' dell'output si adatta al collegamento: se i frame non
+        // escono in tempo per targetFps si passa a colori a 4 bit per canale, poi a 256
+        // colori, poi le zone che cambiano a ogni frame si aggiornano un frame su tre.
+        // Il resto dello schermo resta immediato. A ogni livello le immagini sixel/kitty
+        // si codificano a meta' risoluzione del livello prima. Quando il terminale torna
+        // a tenere il passo si risale un livello alla volta.
+        void setAdaptiveQuality(bool enabled, int targetFps = 30) {
+            adaptiveQuality = enabled;
+            qualityTargetFps = max(1, targetFps);
+            qualityUpWait = qualityTargetFps * 2;
+            outputLoad = 0;
+            framesSinceQualityChange = 0;
+            skipLoadSample = false;
+            if (!enabled && qualityLevel > 0) changeQuality(0);
+        }
+        bool isAdaptiveQuality() const { return adaptiveQuality; }
+        int getQualityLevel() const { return qualityLevel; }
+
+        #ifdef OS_LINUX
+            void presentNonBlocking() {
+                // Finche' il frame precedente non e' uscito tutto questo non puo' partire:
+                // lo si scarta e le sue righe si ridisegnano quando il terminale e' pronto
+                if (!flushOutput()) {
+                    dropParts(0);
+                    return;
+                }
+
+                ssize_t sent = detail::sendParts(outputFd, frameParts, iovScratch, false);
+                if (sent < 0) sent = 0;
+                stats.bytesWritten += sent;
+
+                size_t i = 0, offset = 0;
+                while (i < frameParts.size() && offset + frameParts[i]->size() <= (size_t)sent)
+                    offset += frameParts[i++]->size();
+                if (i == frameParts.size()) {
+                    if (recorder) recorder->frame(frameParts);
+                    stats.framesPresented++;
+                    return;
+                }
+
+                // Terminale lento: si completa solo il pezzo gia' iniziato (non si puo'
+                // interrompere una sequenza) e la coda che chiude il frame; le righe mai
+                // partite restano da ridisegnare contro quello che il terminale ha davvero
+                size_t partial = sent - offset;
+                if (partial > 0) {
+                    pendingOutput.append(frameParts[i]->data() + partial, frameParts[i]->size() - partial);
+                    i++;
+                }
+                bool dropped = dropParts(i);
+                bool closed = sent > 0 && i < frameParts.size();
+                if (closed)
+                    pendingOutput += frameTail;
+                stats.bytesPending = pendingOutput.size();
+                if (!dropped) stats.framesPresented++;
+
+                // Nella registrazione i pezzi partiti (quello a meta' finira' dalla coda)
+                // e la coda di chiusura, non le righe scartate
+                if (recorder && sent > 0) {
+                    vector<const string *> shipped(frameParts.begin(), frameParts.begin() + i);
+                    if (closed) shipped.push_back(&frameTail);
+                    recorder->frame(shipped);
+                }
+            }
+
+            // Dimentica le righe dei pezzi da first in poi; true se ce n'era almeno una
+            bool dropParts(size_t first) {
+                bool any = false;
+                for (size_t k = first; k < frameParts.size(); k++) {
+                    if (framePartRows[k] == -2) {
+                        graphicsLost = true;
+                        any = true;
+                    }
+                    if (framePartRows[k] < 0) continue;
+                    forgetRow(framePartRows[k]);
+                    any = true;
+                }
+                if (any) stats.framesDropped++;
+                return any;
+            }
+        #endif
+
+        void setColorDepth(ColorDepth depth) {
+            if (depth == colorDepth) return;
+            colorDepth = depth;
+            dropRowCache();
+            invalidate();
+        }
+        ColorDepth getColorDepth() const { return colorDepth; }
+
+        // Scrive una singola cella in coordinate schermo (niente pixelMode),
+        // sul layer attivo se presente
+        inline void putCell(int x, int y, char32_t c, const Color &fg, const Color &bg) {
+            if (view.active) {
+                x += view.originX;
+                y += view.originY;
+                if (x < view.clip.x1 || x >= view.clip.x2 || y < view.clip.y1 || y >= view.clip.y2) return;
+            }
+            if (activeLayer) {
+                activeLayer->put(x, y, c, fg, bg, drawAlpha);
+                return;
+            }
+            if (x >= 0 && x < width && y >= 0 && y < height) {
+                // Non lasciare meta' di un glifo largo sullo schermo
+                const vector<char32_t> &row = basePlane()[y];
+                if (row[x] == WIDE_TAIL && x > 0)
+                    storeCell(x - 1, y, U' ', CLEAR, CLEAR);
+                // Anche la coda di un glifo largo scritta sopra la testa di un altro
+                if (x + 1 < width && row[x + 1] == WIDE_TAIL)
+                    storeCell(x + 1, y, U' ', CLEAR, CLEAR);
+                storeCell(x, y, c, fg, bg);
+            }
+        }
+
+        // Scrive un glifo, occupando due celle se e' largo. Ritorna le celle usate.
+        inline int putGlyph(int x, int y, char32_t c, const Color &fg, const Color &bg) {
+            int w = (c < 0x300) ? 1 : detail::GlyphCache::get().width(c);
+            if (w == 0) return 0;
+            if (w == 2) {
+                // Un glifo largo tagliato dal bordo (schermo o clip) diventa spazi
+                int left = view.active ? view.clip.x1 - view.originX : 0;
+                int right = view.active ? view.clip.x2 - view.originX : width;
+                if (x < left || x + 1 >= right) {
+                    putCell(x, y, U' ', fg, bg);
+                    putCell(x + 1, y, U' ', fg, bg);
+                    return w;
+                }
+                putCell(x, y, c, fg, bg);
+                putCell(x + 1, y, WIDE_TAIL, fg, bg);
+                return w;
+            }
+            putCell(x, y, c, fg, bg);
+            return w;
+        }
+
+        // Riempie le celle [x1, x2] della riga y (coordinate schermo) in un colpo solo
+        void fillSpan(int x1, int x2, int y, char32_t c, const Color &fg, const Color &bg) {
+            if (x1 > x2) swap(x1, x2);
+            if (c >= 0x300 && detail::GlyphCache::get().width(c) != 1) {
+                for (int x = x1; x <= x2; )
+                    x += max(1, putGlyph(x, y, c, fg, bg));
+                return;
+            }
+            if (view.active) {
+                x1 = max(x1 + view.originX, view.clip.x1);
+                x2 = min(x2 + view.originX, view.clip.x2 - 1);
+                y += view.originY;
+                if (x1 > x2 || y < view.clip.y1 || y >= view.clip.y2) return;
+            }
+            if (activeLayer) {
+                activeLayer->fillSpan(x1, x2, y, c, fg, bg, drawAlpha);
+                return;
+            }
+            if (y < 0 || y >= height) return;
+            x1 = max(x1, 0);
+            x2 = min(x2, width - 1);
+            if (x1 > x2) return;
+            const vector<char32_t> &row = basePlane()[y];
+            if (row[x1] == WIDE_TAIL && x1 > 0) storeCell(x1 - 1, y, U' ', CLEAR, CLEAR);
+            if (x2 + 1 < width && row[x2 + 1] == WIDE_TAIL) storeCell(x2 + 1, y, U' ', CLEAR, CLEAR);
+            for (int x = x1; x <= x2; x++)
+                storeCell(x, y, c, fg, bg);
+        }
+
+        void write(int x, int y, char32_t c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+            if (pixelMode) {
+                x *= 2;
+                // Un glifo largo riempie gia' tutto il pixel
+                if (putGlyph(x, y, c, fg, bg) == 1)
+                    putCell(x + 1, y, c, fg, bg);
+                return;
+            }
+            putGlyph(x, y, c, fg, bg);
+        }
+
+        // I char sono CP437, come prima
+        void write(int x, int y, char c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+            write(x, y, detail::cp437ToCodepoint(c), fg, bg);
+        }
+
+        // Testo UTF-8 (i byte non validi vengono letti come CP437)
+        void write(int x, int y, string_view text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+            if (pixelMode) x *= 2;
+            const char *p = text.data(), *end = p + text.size();
+            int currentX = x;
+            while (p < end) {
+                char32_t c = detail::decodeUtf8(p, end);
+                int w = putGlyph(currentX, y, c, fg, bg);
+                if (pixelMode && w == 1) {
+                    putCell(currentX + 1, y, c, fg, bg);
+                    w = 2;
+                }
+                currentX += w;
+            }
+        }
+
+        void showCursor(bool visible) {
+            if (visible)
+                cout << "\033[?25h";
+            else
+                cout << "\033[?25l";
+            cout.flush();
+        }
+
+        // Dentro una View sono le dimensioni della vista
+        int getWidth() const {
+            int w = view.active ? view.w : externalCells ? externalWidth : width;
+            return pixelMode ? w / 2 : w;
+        }
+        int getHeight() const { return view.active ? view.h : externalCells ? externalHeight : height; }
+        pair<int, int> getSize() const { return {getWidth(), getHeight()}; }
+
+        Color getFgColor(int x, int y) const {
+            if (x >= 0 && x < width && y >= 0 && y < height)
+                return fgBuffer[y][x];
+            return DEFAULT_FG;
+        }
+
+        Color getBgColor(int x, int y) const {
+            if (x >= 0 && x < width && y >= 0 && y < height)
+                return bgBuffer[y][x];
+            return DEFAULT_BG;
+        }
+
+        void setPixelMode(bool state) { pixelMode = state; }
+        bool isInPixelMode() const { return pixelMode; }
+
+        // Valuta shader(x, y) -> pwetty::Cell per ogni cella di una regione (estremi inclusi,
+        // coordinate come write(): pixel se pixelMode) e scrive il risultato nei buffer.
+        // Le righe sono divise in blocchi eseguiti in parallelo sul pool: lo shader viene
+        // chiamato da piu' thread insieme e deve solo leggere lo stato condiviso.
+        // Con un layer o una View attivi si passa da putCell, sul thread chiamante.
+        template <class Shader>
+        void shade(int x1, int y1, int x2, int y2, Shader &&shader) {
+            if (x1 > x2) swap(x1, x2);
+            if (y1 > y2) swap(y1, y2);
+            PWETTY_ZONE("shade");
+            int cx = pixelMode ? 2 : 1;
+
+            if (activeLayer || view.active) {
+                for (int y = y1; y <= y2; y++)
+                    for (int x = x1; x <= x2; x++) {
+                        pwetty::Cell c = shader(x, y);
+                        for (int k = 0; k < cx; k++)
+                            putCell(x * cx + k, y, c.ch ? c.ch : cellAt(x * cx + k, y), c.fg, c.bg);
+                    }
+                return;
+            }
+
+            x1 = max(x1, 0);
+            x2 = min(x2, width / cx - 1);
+            y1 = max(y1, 0);
+            y2 = min(y2, height - 1);
+            if (x1 > x2 || y1 > y2) return;
+
+            // Con dei layer si scrive il piano base e poi lo si copia sullo schermo
+            bool base = !layers.empty();
+            int rows = y2 - y1 + 1;
+            int tiles = min(rows, workers().size() * 4);
+            workers().run(tiles, [&](int tile) {
+                int ty1 = y1 + rows * tile / tiles, ty2 = y1 + rows * (tile + 1) / tiles;
+                for (int y = ty1; y < ty2; y++) {
+                    vector<char32_t> &row = base ? baseBuffer[y] : buffer[y];
+                    vector<Color> &fgRow = base ? baseFgBuffer[y] : fgBuffer[y];
+                    vector<Color> &bgRow = base ? baseBgBuffer[y] : bgBuffer[y];
+                    // Glifi larghi tagliati dai bordi della regione
+                    int left = x1 * cx, right = x2 * cx + cx - 1;
+                    if (row[left] == WIDE_TAIL && left > 0) row[left - 1] = U' ';
+                    if (right + 1 < width && row[right + 1] == WIDE_TAIL) row[right + 1] = U' ';
+
+                    for (int x = x1; x <= x2; x++) {
+                        pwetty::Cell c = shader(x, y);
+                        // Una cella sola per glifo: quelli larghi non ci stanno
+                        if (c.ch >= 0x300 && detail::computeGlyphWidth(c.ch) != 1) c.ch = U' ';
+                        for (int k = 0, sx = x * cx; k < cx; k++, sx++) {
+                            if (c.ch) row[sx] = c.ch;
+                            else if (row[sx] == WIDE_TAIL) row[sx] = U' ';
+                            if (c.fg != CLEAR) fgRow[sx] = c.fg;
+                            if (c.bg != CLEAR) bgRow[sx] = c.bg;
+                        }
+                    }
+                    if (base) {
+                        int from = max(left - 1, 0), to = min(right + 2, width);
+                        copy(row.begin() + from, row.begin() + to, buffer[y].begin() + from);
+                        copy(fgRow.begin() + from, fgRow.begin() + to, fgBuffer[y].begin() + from);
+                        copy(bgRow.begin() + from, bgRow.begin() + to, bgBuffer[y].begin() + from);
+                    }
+                }
+            });
+            // Anche le celle appena fuori, per i glifi larghi tagliati
+            markStale(x1 * cx - 1, y1, x2 * cx + cx + 1, y2 + 1);
+            if (base) markBaseDirty({x1 * cx - 1, y1, x2 * cx + cx + 1, y2 + 1});
+        }
+
+        template <class Shader>
+        void shade(Shader &&shader) {
+            shade(0, 0, getWidth() - 1, getHeight() - 1, shader);
+        }
+
+        char32_t cellAt(int x, int y) const {
+            if (view.active) { x += view.originX; y += view.originY; }
+            if (activeLayer) return activeLayer->cellAt(x, y);
+            if (x >= 0 && x < width && y >= 0 && y < height) return basePlane()[y][x];
+            return U' ';
+        }
+
+        // Usati da pwetty::View per applicare e ripristinare la propria trasformazione
+        const ViewState &getViewState() const { return view; }
+        void setViewState(const ViewState &state) { view = state; }
+
+        // ======================== GRAPHICS ========================
+        // Dimensione di una cella in pixel, per le immagini con protocollo grafico
+        void getCellPixelSize(int &w, int &h) const {
+            w = 10;
+            h = 20;
+            #ifdef OS_LINUX
+                struct winsize ws;
+                if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_xpixel > 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+                    w = ws.ws_xpixel / ws.ws_col;
+                    h = ws.ws_ypixel / ws.ws_row;
+                }
+            #endif
+        }
+
+        // Mostra un'immagine sul rettangolo di celle di g (coordinate schermo, gia'
+        // ritagliate) al prossimo render(). Le celle sotto diventano spazi.
+        void placeGraphic(detail::GraphicPlacement g) {
+            ViewState saved = view;
+            view.active = false;
+            for (int y = g.y; y < g.y + g.h; y++)
+                for (int x = g.x; x < g.x + g.w; x++)
+                    putCell(x, y, U' ', DEFAULT_FG, DEFAULT_BG);
+            view = saved;
+            graphics.push_back(move(g));
+        }
+
+        // Prima delle celle: le immagini sparite o cambiate lasciano il posto al testo.
+        // Un'immagine kitty si cancella; sopra un sixel si riscrivono le celle.
+        void retireGraphics() {
+            // Schermo ridisegnato o payload perso: kitty riparte da zero
+            if (graphicsLost && !kittyImages.empty()) {
+                frameHead += "\033_Ga=d,d=A,q=2\033\\";
+                kittyImages.clear();
+            }
+            for (const auto &old : graphicsShown) {
+                bool kept = false;
+                if (!graphicsLost) {
+                    for (auto &g : graphics) {
+                        if (!g.encode || !g.sameAs(old)) continue;
+                        g.encode = nullptr;
+                        g.placementId = old.placementId;
+                        kept = true;
+                        break;
+                    }
+                }
+                if (kept) continue;
+                if (old.kitty) {
+                    if (graphicsLost) continue;
+                    frameHead += "\033_Ga=d,d=i,i=";
+                    detail::appendInt(frameHead, old.imageId());
+                    frameHead += ",p=";
+                    detail::appendInt(frameHead, old.placementId);
+                    frameHead += ",q=2\033\\";
+                    continue;
+                }
+                for (int y = old.y; y < old.y + old.h && y < height; y++)
+                    fill(prevBuffer[y].begin() + old.x, prevBuffer[y].begin() + min(width, old.x + old.w), U'\0');
+                forgetTiles(old.x, old.y, old.x + old.w, old.y + old.h);
+            }
+            graphicsLost = false;
+        }
+
+        // Dopo le celle: i payload delle immagini nuove. Con kitty un'immagine gia' nella
+        // memoria del terminale si mostra di nuovo senza ritrasmetterla.
+        void emitGraphics() {
+            frameGraphics.clear();
+            int onScreen = 0;
+            for (auto &g : graphics) {
+                if (g.kitty) onScreen++;
+                if (g.encode) {
+                    g.placementId = lastPlacementId = lastPlacementId % 0x7FFFFFFF + 1;
+                    frameGraphics += "\033[";
+                    detail::appendInt(frameGraphics, g.y + 1); frameGraphics += ';';
+                    detail::appendInt(frameGraphics, g.x + 1); frameGraphics += 'H';
+                    if (g.kitty && find(kittyImages.begin(), kittyImages.end(), g.imageId()) != kittyImages.end()) {
+                        frameGraphics += "\033_Ga=p,i=";
+                        detail::appendInt(frameGraphics, g.imageId());
+                        frameGraphics += ",p=";
+                        detail::appendInt(frameGraphics, g.placementId);
+                        frameGraphics += ",c=";
+                        detail::appendInt(frameGraphics, g.w);
+                        frameGraphics += ",r=";
+                        detail::appendInt(frameGraphics, g.h);
+                        frameGraphics += ",C=1,q=2\033\\";
+                    } else {
+                        g.encode(frameGraphics, g.imageId(), g.placementId);
+                    }
+                    g.encode = nullptr;
+                }
+                // kittyImages va dalla meno usata di recente alla piu' recente
+                if (g.kitty) {
+                    kittyImages.erase(remove(kittyImages.begin(), kittyImages.end(), g.imageId()), kittyImages.end());
+                    kittyImages.push_back(g.imageId());
+                }
+            }
+
+            // In memoria al massimo 16 immagini, piu' quelle sullo schermo
+            while ((int)kittyImages.size() > max(16, onScreen)) {
+                frameGraphics += "\033_Ga=d,d=I,i=";
+                detail::appendInt(frameGraphics, kittyImages.front());
+                frameGraphics += ",q=2\033\\";
+                kittyImages.erase(kittyImages.begin());
+            }
+            graphicsShown.swap(graphics);
+            graphics.clear();
+        }
+
+        // ======================== LAYER MANAGEMENT ========================
+        Layer *findLayer(const string &name) {
+            for (auto &layer : layers)
+                if (layer->name == name) return layer.get();
+            return nullptr;
+        }
+
+        Layer &createLayer(const string &name, int z) {
+            ensureSize();
+            if (Layer *existing = findLayer(name)) {
+                setLayerZ(name, z);
+                return *existing;
+            }
+            // Il primo layer: quello che c'e' sullo schermo diventa il piano base
+            if (layers.empty()) copyBasePlane();
+            layers.push_back(make_unique<Layer>(name, z, width, height));
+            Layer &created = *layers.back();
+            sortLayers();
+            return created;
+        }
+
+        void removeLayer(const string &name) {
+            Layer *layer = findLayer(name);
+            if (!layer) return;
+            if (activeLayer == layer) activeLayer = nullptr;
+            layers.erase(remove_if(layers.begin(), layers.end(),
+                                   [&](const unique_ptr<Layer> &l) { return l.get() == layer; }),
+                         layers.end());
+            if (!layers.empty()) {
+                fullRecompose = true;
+                return;
+            }
+            // Senza layer lo schermo torna a essere il piano base
+            buffer.swap(baseBuffer);
+            fgBuffer.swap(baseFgBuffer);
+            bgBuffer.swap(baseBgBuffer);
+            baseBuffer.clear();
+            baseFgBuffer.clear();
+            baseBgBuffer.clear();
+            baseDirty.clear();
+            fullRecompose = false;
+            markStale(0, 0, width, height);
+        }
+
+        // Redirige tutte le funzioni di disegno sul layer indicato ("" = schermo)
+        void setLayer(const string &name) {
+            activeLayer = name.empty() ? nullptr : findLayer(name);
+        }
+
+        void setLayerZ(const string &name, int z) {
+            if (Layer *layer = findLayer(name)) {
+                if (layer->z == z) return;
+                layer->z = z;
+                layer->markDirty({0, 0, layer->width, layer->height});
+                sortLayers();
+            }
+        }
+
+        void setLayerVisible(const string &name, bool visible) {
+            if (Layer *layer = findLayer(name)) {
+                if (layer->visible == visible) return;
+                layer->visible = visible;
+                layer->markDirty({0, 0, layer->width, layer->height});
+            }
+        }
+
+        void setLayerOpacity(const string &name, int opacity) {
+            if (Layer *layer = findLayer(name)) {
+                opacity = max(0, min(255, opacity));
+                if (layer->opacity == opacity) return;
+                layer->opacity = (uint8_t)opacity;
+                layer->markDirty({0, 0, layer->width, layer->height});
+            }
+        }
+
+        // Alpha usato dalle prossime scritture sul layer attivo
+        void setDrawAlpha(int alpha) { drawAlpha = (uint8_t)max(0, min(255, alpha)); }
+
+        // Ricompone nel buffer dello schermo solo le zone in cui qualche layer e' cambiato
+        void composite() {
+            if (layers.empty()) return;
+            PWETTY_ZONE("composite");
+
+            // Unisce le regioni sovrapposte per non ricomporre due volte
+            vector<Rect> regions;
+            if (fullRecompose) {
+                regions.push_back({0, 0, width, height});
+            } else {
+                regions.swap(baseDirty);
+                for (auto &layer : layers)
+                    addRegion(regions, layer->dirty);
+            }
+
+            for (const Rect &r : regions)
+                compositeRegion(r);
+
+            for (auto &layer : layers)
+                layer->dirty = {0, 0, 0, 0};
+            baseDirty.clear();
+            fullRecompose = false;
+        }
+
+    private:
+        // Il piano base parte da quello che c'e' ora sullo schermo
+        void copyBasePlane() {
+            baseBuffer = buffer;
+            baseFgBuffer = fgBuffer;
+            baseBgBuffer = bgBuffer;
+        }
+
+        void resizeBasePlane() {
+            baseBuffer.resize(height);
+            baseFgBuffer.resize(height);
+            baseBgBuffer.resize(height);
+            for (int y = 0; y < height; ++y) {
+                baseBuffer[y].resize(width, U' ');
+                baseFgBuffer[y].resize(width, DEFAULT_FG);
+                baseBgBuffer[y].resize(width, DEFAULT_BG);
+            }
+        }
+
+        void sortLayers() {
+            stable_sort(layers.begin(), layers.end(),
+                        [](const unique_ptr<Layer> &a, const unique_ptr<Layer> &b) { return a->z < b->z; });
+        }
+
+        void compositeRegion(Rect r) {
+            r.x1 = max(r.x1, 0); r.y1 = max(r.y1, 0);
+            r.x2 = min(r.x2, width); r.y2 = min(r.y2, height);
+
+            // I layer si fondono sopra il piano base (il disegno diretto sullo schermo)
+            for (int y = r.y1; y < r.y2; ++y) {
+                for (int x = r.x1; x < r.x2; ++x) {
+                    char32_t c = baseBuffer[y][x];
+                    Color fg = baseFgBuffer[y][x];
+                    Color bg = baseBgBuffer[y][x];
+
+                    for (auto &layer : layers) {
+                        if (!layer->visible) continue;
+                        int a = layer->alphaBuffer[y][x] * layer->opacity / 255;
+                        if (a == 0) continue;
+
+                        const Color &lbg = layer->bgBuffer[y][x];
+                        char32_t lc = layer->buffer[y][x];
+                        bool opaqueBg = (lbg != CLEAR && a == 255);
+
+                        if (lbg != CLEAR)
+                            bg = blendColor(lbg, bg, a);
+                        // Uno spazio non copre il glifo sottostante, a meno che lo sfondo sia opaco
+                        if (lc != U' ' || opaqueBg) {
+                            c = lc;
+                            // Su uno sfondo speciale (DEFAULT_BG) il glifo non si puo' sfumare
+                            fg = bg.r < 0 ? layer->fgBuffer[y][x] : blendColor(layer->fgBuffer[y][x], bg, a);
+                        }
+                    }
+
+                    buffer[y][x] = c;
+                    fgBuffer[y][x] = fg;
+                    bgBuffer[y][x] = bg;
+                }
+            }
+            markStale(r.x1, r.y1, r.x2, r.y2);
+        }
+    };
+}
+
+// ======================== BASIC CONSOLE ========================
+// Backend: dove finisce il frame codificato
+struct AnsiBackend {
+    static void present(detail::Console &c) { c.present(); }
+};
+
+// Scarta l'output (benchmark, test senza terminale)
+struct NullBackend {
+    static void present(detail::Console &) {}
+};
+
+// Vista tipizzata sulla console: modello colore, layout e backend sono fissati a compile
+// time, quindi i cicli interni non controllano pixelMode. Il controllo su CLEAR si fa una
+// volta per chiamata invece che per cella. I buffer sono quelli del singleton, quindi si
+// puo' mescolare con le funzioni globali, che sono DefaultConsole / DefaultPixelConsole.
+template <class ColorModel = TrueColorModel, class PixelLayout = TextCells, class Backend = AnsiBackend>
+class BasicConsole {
+public:
+    static constexpr int cellsPerX = PixelLayout::cellsPerX;
+
+    BasicConsole() : c(detail::Console::get()) {}
+
+    void clear(Color bg = DEFAULT_BG) { c.clear(bg); }
+
+    void render() {
+        c.template buildFrame<ColorModel>();
+        Backend::present(c);
+    }
+
+    void write(int x, int y, char32_t ch, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+        if (fg == CLEAR || bg == CLEAR) put<true>(x * cellsPerX, y, ch, fg, bg);
+        else put<false>(x * cellsPerX, y, ch, fg, bg);
+    }
+
+    void write(int x, int y, char ch, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+        write(x, y, detail::cp437ToCodepoint(ch), fg, bg);
+    }
+
+    void write(int x, int y, string_view text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+        if (fg == CLEAR || bg == CLEAR) writeText<true>(x, y, text, fg, bg);
+        else writeText<false>(x, y, text, fg, bg);
+    }
+
+    void fillSpan(int x1, int x2, int y, char32_t ch, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+        if (x1 > x2) swap(x1, x2);
+        c.fillSpan(x1 * cellsPerX, x2 * cellsPerX + cellsPerX - 1, y, ch, fg, bg);
+    }
+
+    int getWidth() const { return c.width / cellsPerX; }
+    int getHeight() const { return c.height; }
+
+private:
+    detail::Console &c;
+
+    // Cella singola: senza CLEAR, layer o View e' solo un controllo dei bordi e tre store.
+    // Tutto il resto passa da putCell, l'unico punto che conosce layer e View.
+    template <bool KeepColors>
+    inline void store(int x, int y, char32_t ch, const Color &fg, const Color &bg) {
+        if constexpr (KeepColors) {
+            c.putCell(x, y, ch, fg, bg);
+        } else {
+            if (c.activeLayer || !c.layers.empty() || c.view.active || (unsigned)x >= (unsigned)c.width ||
+                (unsigned)y >= (unsigned)c.height) {
+                c.putCell(x, y, ch, fg, bg);
+                return;
+            }
+            c.buffer[y][x] = ch;
+            c.fgBuffer[y][x] = fg;
+            c.bgBuffer[y][x] = bg;
+            c.markStale(x, y);
+        }
+    }
+
+    // Vicino a un glifo largo: la cella scritta e' una coda (la testa resta orfana) o
+    // la cella dopo l'ultima scritta lo e' (resterebbe la coda senza testa)
+    bool nearWide(int x, int y) const {
+        if ((unsigned)x >= (unsigned)c.width || (unsigned)y >= (unsigned)c.height) return false;
+        const vector<char32_t> &row = c.basePlane()[y];
+        return row[x] == WIDE_TAIL || (x + cellsPerX < c.width && row[x + cellsPerX] == WIDE_TAIL);
+    }
+
+    template <bool KeepColors>
+    inline int put(int x, int y, char32_t ch, const Color &fg, const Color &bg) {
+        if (ch >= 0x300 || nearWide(x, y)) {
+            // Glifi larghi o vicini a glifi larghi: percorso completo
+            int w = c.putGlyph(x, y, ch, fg, bg);
+            if constexpr (cellsPerX == 2) {
+                if (w == 1) c.putCell(x + 1, y, ch, fg, bg);
+                return w == 0 ? 0 : 2;
+            }
+            return w;
+        }
+        store<KeepColors>(x, y, ch, fg, bg);
+        if constexpr (cellsPerX == 2)
+            store<KeepColors>(x + 1, y, ch, fg, bg);
+        return cellsPerX;
+    }
+
+    template <bool KeepColors>
+    void writeText(int x, int y, string_view text, const Color &fg, const Color &bg) {
+        const char *p = text.data(), *end = p + text.size();
+        int currentX = x * cellsPerX;
+        while (p < end) {
+            char32_t ch = (unsigned char)*p < 0x80 ? (char32_t)*p++ : detail::decodeUtf8(p, end);
+            currentX += put<KeepColors>(currentX, y, ch, fg, bg);
+        }
+    }
+};
+
+using TrueColorConsole = BasicConsole<TrueColorModel, TextCells, AnsiBackend>;
+using TrueColorPixelConsole = BasicConsole<TrueColorModel, PixelCells, AnsiBackend>;
+using Console256 = BasicConsole<Color256Model, TextCells, AnsiBackend>;
+using PixelConsole256 = BasicConsole<Color256Model, PixelCells, AnsiBackend>;
+
+// Le funzioni globali: setPixelMode si puo' cambiare mentre si disegna, quindi la
+// variante (testo o pixel) si sceglie a ogni chiamata e da li' in poi e' fissata
+#ifdef PWETTY_COLOR_256
+using DefaultConsole = Console256;
+using DefaultPixelConsole = PixelConsole256;
+#else
+using DefaultConsole = TrueColorConsole;
+using DefaultPixelConsole = TrueColorPixelConsole;
+#endif
+
+// ======================== GLOBAL FUNCTIONS ========================
+inline detail::Console& console() { return detail::Console::get(); }
+
+// Display functions
+inline void clearScreen(Color bg = DEFAULT_BG) { console().clear(bg); }
+inline void resetTerminal() { console().resetTerminal(); }
+inline void render() { console().render(); }
+inline void invalidateScreen() { console().invalidate(); }
+inline void setCapabilities(const Capabilities &caps) { console().setCapabilities(caps); }
+inline Capabilities terminalCapabilities() { return console().getCapabilities(); }
+inline void setColorDepth(ColorDepth depth) { console().setColorDepth(depth); }
+inline ColorDepth getColorDepth() { return console().getColorDepth(); }
+inline void setEncodeThreads(int threads) { console().setEncodeThreads(threads); }
+inline int getEncodeThreads() { return console().getEncodeThreads(); }
+inline void setAdaptiveQuality(bool enabled, int targetFps = 30) { console().setAdaptiveQuality(enabled, targetFps); }
+inline int getQualityLevel() { return console().getQualityLevel(); }
+#ifdef OS_LINUX
+inline void probeCapabilities() { console().probeCapabilities(); }
+#endif
+
+// Recording functions
+inline bool startRecording(const string &path) { return console().startRecording(path); }
+inline void stopRecording() { console().stopRecording(); }
+inline bool isRecording() { return console().isRecording(); }
+inline size_t recordingDroppedFrames() { return console().recordingDroppedFrames(); }
+#ifdef OS_LINUX
+inline void setOutputFd(int fd) { console().setOutputFd(fd); }
+inline void setNonBlockingOutput(bool enabled) { console().setNonBlockingOutput(enabled); }
+inline bool flushOutput(bool wait = false) { return console().flushOutput(wait); }
+
+// Sharing functions
+inline bool startSharing(const string &path) { return console().startSharing(path); }
+inline void stopSharing() { console().stopSharing(); }
+inline int sharedViewerCount() { return console().viewerCount(); }
+#endif
+inline OutputStats outputStats() { return console().getOutputStats(); }
+inline void resetOutputStats() { console().resetOutputStats(); }
+
+inline void write(int x, int y, char c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (console().isInPixelMode()) DefaultPixelConsole().write(x, y, c, fg, bg);
+    else DefaultConsole().write(x, y, c, fg, bg);
+}
+
+inline void write(int x, int y, char32_t c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (console().isInPixelMode()) DefaultPixelConsole().write(x, y, c, fg, bg);
+    else DefaultConsole().write(x, y, c, fg, bg);
+}
+
+inline void write(int x, int y, string_view text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (console().isInPixelMode()) DefaultPixelConsole().write(x, y, text, fg, bg);
+    else DefaultConsole().write(x, y, text, fg, bg);
+}
+
+inline void writeAligned(Alignment align, int y, string_view text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    detail::Console &c = console();
+    int textW = textWidth(text);
+    if (c.isInPixelMode()) textW = (textW + 1) / 2;
+    int x = 0;
+    if (align == Alignment::Center)
+        x = (c.getWidth() - textW) / 2;
+    else if (align == Alignment::Right)
+        x = c.getWidth() - textW;
+    write(x, y, text, fg, bg);
+}
+
+// Testo formattato (vedi TEXT FORMAT), nessuna allocazione
+template <class... Args>
+inline void writef(int x, int y, Color fg, Color bg, string_view fmt, const Args &...args) {
+    detail::FormatBuffer text;
+    detail::format(text, fmt, args...);
+    write(x, y, text.view(), fg, bg);
+}
+
+template <class... Args>
+inline void writef(int x, int y, string_view fmt, const Args &...args) {
+    writef(x, y, DEFAULT_FG, DEFAULT_BG, fmt, args...);
+}
+
+template <class... Args>
+inline void writeAlignedf(Alignment align, int y, Color fg, Color bg, string_view fmt, const Args &...args) {
+    detail::FormatBuffer text;
+    detail::format(text, fmt, args...);
+    writeAligned(align, y, text.view(), fg, bg);
+}
+
+template <class... Args>
+inline void writeAlignedf(Alignment align, int y, string_view fmt, const Args &...args) {
+    writeAlignedf(align, y, DEFAULT_FG, DEFAULT_BG, fmt, args...);
+}
+
+inline void showCursor(bool visible) { console().showCursor(visible); }
+
+// Shader per cella in parallelo, vedi Console::shade
+template <class Shader>
+inline void shade(Shader &&shader) { console().shade(shader); }
+
+template <class Shader>
+inline void shade(int x1, int y1, int x2, int y2, Shader &&shader) { console().shade(x1, y1, x2, y2, shader); }
+
+inline int terminalWidth() { return console().getWidth(); }
+inline int terminalHeight() { return console().getHeight(); }
+inline pair<int, int> terminalSize() { return console().getSize(); }
+
+inline Color getFgColor(int x, int y) { return console().getFgColor(x, y); }
+inline Color getBgColor(int x, int y) { return console().getBgColor(x, y); }
+
+inline void setPixelMode(bool state) { console().setPixelMode(state); }
+inline bool isInPixelMode() { return console().isInPixelMode(); }
+
+// ======================== INDEXED CONSOLE ========================
+// Indici della palette iniziale: i 16 colori con nome, poi cubo 6x6x6 e grigi
+enum PaletteIndex : uint8_t {
+    PAL_BLACK, PAL_BLUE, PAL_GREEN, PAL_CYAN, PAL_RED, PAL_VIOLET, PAL_BROWN, PAL_LIGHT_GRAY,
+    PAL_GRAY, PAL_LIGHT_BLUE, PAL_LIME, PAL_TURQUOISE, PAL_LIGHT_RED, PAL_PINK, PAL_YELLOW, PAL_WHITE,
+    PAL_CUBE = 16,         // 16 + 36 * r + 6 * g + b, componenti 0-5
+    PAL_GRAYS = 232,       // 22 livelli di grigio
+    PAL_DEFAULT_FG = 254,
+    PAL_DEFAULT_BG = 255
+};
+
+// Console a celle indicizzate: ogni cella e' un uint32 (glifo BMP a 16 bit, indici fg e bg
+// a 8 bit) e i colori veri stanno in una palette condivisa da 256 voci. Finche' esiste le
+// celle dello schermo sono queste: la console libera i suoi buffer RGB (56 byte a cella
+// tra frame attuale e precedente) e restano 8 byte a cella, 4 per il frame e 4 per la
+// copia di quello mostrato. render() confronta le righe 4 celle alla volta (SSE2) e
+// codifica direttamente le celle cambiate o quelle che usano una voce di palette cambiata,
+// risolvendo il colore solo li': un effetto di palette (rotazione, dissolvenza) ridisegna
+// lo schermo senza toccare le celle.
+// Lo schermo e' tutto suo: intanto le funzioni globali di disegno, i layer e le View non
+// hanno celle su cui scrivere e non fanno niente. Quando l'ultima IndexedConsole viene
+// distrutta la console riprende i suoi buffer e il render() dopo ridisegna tutto.
+class IndexedConsole {
+public:
+    static constexpr uint32_t WIDE_TAIL_GLYPH = 0xFFFF;
+
+    IndexedConsole() : c(console()), width(0), height(0) {
+        c.acquireExternalCells();
+        const Color named[16] = {BLACK, BLUE, GREEN, CYAN, RED, VIOLET, BROWN, LIGHT_GRAY,
+                                 GRAY, LIGHT_BLUE, LIME, TURQUOISE, LIGHT_RED, PINK, YELLOW, WHITE};
+        static const int levels[6] = {0, 95, 135, 175, 215, 255};
+        for (int i = 0; i < 16; i++) palette[i] = named[i];
+        for (int i = 0; i < 216; i++)
+            palette[PAL_CUBE + i] = Color(levels[i / 36], levels[i / 6 % 6], levels[i % 6]);
+        for (int i = 0; i < 22; i++)
+            palette[PAL_GRAYS + i] = Color(8 + i * 11, 8 + i * 11, 8 + i * 11);
+        palette[PAL_DEFAULT_FG] = DEFAULT_FG;
+        palette[PAL_DEFAULT_BG] = DEFAULT_BG;
+        prevPalette = palette;
+        resize();
+    }
+
+    ~IndexedConsole() { c.releaseExternalCells(); }
+
+    IndexedConsole(const IndexedConsole &) = delete;
+    IndexedConsole &operator=(const IndexedConsole &) = delete;
+
+    static uint32_t pack(char32_t ch, uint8_t fg, uint8_t bg) {
+        uint32_t glyph = ch == WIDE_TAIL ? WIDE_TAIL_GLYPH : ch < 0xFFFF ? (uint32_t)ch : 0xFFFD;
+        return glyph | (uint32_t)fg << 16 | (uint32_t)bg << 24;
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    void clear(uint8_t bg = PAL_DEFAULT_BG) {
+        fill(cells.begin(), cells.end(), pack(U' ', PAL_DEFAULT_FG, bg));
+    }
+
+    void write(int x, int y, char32_t ch, uint8_t fg = PAL_DEFAULT_FG, uint8_t bg = PAL_DEFAULT_BG) {
+        int w = (ch < 0x300) ? 1 : glyphWidth(ch);
+        if (w == 0) return;
+        if (w == 2 && x + 1 < width) {
+            put(x, y, pack(ch, fg, bg));
+            put(x + 1, y, pack(WIDE_TAIL, fg, bg));
+        } else {
+            put(x, y, pack(w == 2 ? U' ' : ch, fg, bg));
+        }
+    }
+
+    void write(int x, int y, char ch, uint8_t fg = PAL_DEFAULT_FG, uint8_t bg = PAL_DEFAULT_BG) {
+        write(x, y, detail::cp437ToCodepoint(ch), fg, bg);
+    }
+
+    void write(int x, int y, string_view text, uint8_t fg = PAL_DEFAULT_FG, uint8_t bg = PAL_DEFAULT_BG) {
+        const char *p = text.data(), *end = p + text.size();
+        while (p < end) {
+            char32_t ch = detail::decodeUtf8(p, end);
+            write(x, y, ch, fg, bg);
+            x += glyphWidth(ch);
+        }
+    }
+
+    // Celle [x1, x2] della riga y
+    void fillSpan(int x1, int x2, int y, char32_t ch, uint8_t fg = PAL_DEFAULT_FG, uint8_t bg = PAL_DEFAULT_BG) {
+        if (x1 > x2) swap(x1, x2);
+        if (y < 0 || y >= height) return;
+        x1 = max(x1, 0);
+        x2 = min(x2, width - 1);
+        if (x1 > x2) return;
+        uint32_t *row = &cells[(size_t)y * width];
+        if ((row[x1] & 0xFFFF) == WIDE_TAIL_GLYPH && x1 > 0) row[x1 - 1] = (row[x1 - 1] & 0xFFFF0000) | U' ';
+        if (x2 + 1 < width && (row[x2 + 1] & 0xFFFF) == WIDE_TAIL_GLYPH) row[x2 + 1] = (row[x2 + 1] & 0xFFFF0000) | U' ';
+        fill(row + x1, row + x2 + 1, pack(ch, fg, bg));
+    }
+
+    // ---- Palette ----
+    void setPaletteColor(uint8_t index, const Color &color) { palette[index] = color; }
+    const Color &getPaletteColor(uint8_t index) const { return palette[index]; }
+    void setPalette(const array<Color, 256> &colors) { palette = colors; }
+    const array<Color, 256> &getPalette() const { return palette; }
+
+    // Ruota le voci [first, last] di un passo (color cycling)
+    void rotatePalette(uint8_t first, uint8_t last, int step = 1) {
+        if (first >= last) return;
+        int n = last - first + 1;
+        step = ((step % n) + n) % n;
+        rotate(palette.begin() + first, palette.begin() + first + (n - step) % n, palette.begin() + last + 1);
+    }
+
+    // Voce piu' vicina a un colore tra [first, last]
+    uint8_t nearest(const Color &color, int first = 0, int last = 253) const {
+        int best = first;
+        double bestDist = INFINITY;
+        for (int i = first; i <= last; i++) {
+            double d = colorDistance(color, palette[i]);
+            if (d < bestDist) { bestDist = d; best = i; }
+        }
+        return (uint8_t)best;
+    }
+
+    void render() {
+        c.ensureSize();
+        if (c.externalWidth != width || c.externalHeight != height) resize();
+
+        // Voci cambiate dall'ultimo render
+        bool paletteChanged = false;
+        array<bool, 256> changed;
+        for (int i = 0; i < 256; i++) {
+            changed[i] = palette[i] != prevPalette[i];
+            paletteChanged |= changed[i];
+        }
+
+        detail::EncoderState st;
+        bool color256 = c.getColorDepth() == ColorDepth::Color256;
+        for (int y = 0; y < height; y++) {
+            rowOutput[y].clear();
+            if (color256)
+                encodeRow<Color256Model>(y, paletteChanged ? &changed : nullptr, rowOutput[y], st);
+            else
+                encodeRow<TrueColorModel>(y, paletteChanged ? &changed : nullptr, rowOutput[y], st);
+        }
+        prevPalette = palette;
+        c.presentExternal(rowOutput);
+
+        // Righe mai arrivate al terminale (output non bloccante, invalidateScreen):
+        // al prossimo render si rimandano per intero
+        for (int y = 0; y < height && y < (int)c.externalRowsLost.size(); y++) {
+            if (!c.externalRowsLost[y]) continue;
+            fill(prevCells.begin() + (size_t)y * width, prevCells.begin() + (size_t)(y + 1) * width, 0);
+            c.externalRowsLost[y] = 0;
+        }
+    }
+
+private:
+    detail::Console &c;
+    int width, height;
+    vector<uint32_t> cells, prevCells;
+    array<Color, 256> palette, prevPalette;
+    vector<string> rowOutput;
+
+    void resize() {
+        width = c.externalWidth;
+        height = c.externalHeight;
+        cells.assign((size_t)width * height, pack(U' ', PAL_DEFAULT_FG, PAL_DEFAULT_BG));
+        // Valore impossibile (glifo 0): al primo render si manda tutto
+        prevCells.assign(cells.size(), 0);
+        rowOutput.assign(height, string());
+    }
+
+    static char32_t glyphOf(uint32_t cell) { return (char32_t)(cell & 0xFFFF); }
+
+    // Le celle cambiate della riga y (o con una voce di palette in changed), a run di
+    // celle uguali come l'encoder della console. Poi la riga diventa quella mostrata.
+    template <class Model>
+    void encodeRow(int y, const array<bool, 256> *changed, string &out, detail::EncoderState &st) {
+        detail::GlyphCache &glyphs = detail::GlyphCache::get();
+        const Capabilities &caps = c.getCapabilities();
+        const uint32_t *row = &cells[(size_t)y * width];
+        uint32_t *prevRow = &prevCells[(size_t)y * width];
+        auto differs = [&](int x) {
+            return row[x] != prevRow[x] || (changed && ((*changed)[row[x] >> 16 & 0xFF] || (*changed)[row[x] >> 24]));
+        };
+
+        int x = 0;
+        while (x < width) {
+            #ifdef PWETTY_SSE2
+                // Senza cambi di palette si saltano 4 celle uguali alla volta
+                if (!changed && x + 4 <= width) {
+                    __m128i a = _mm_loadu_si128((const __m128i *)(row + x));
+                    __m128i b = _mm_loadu_si128((const __m128i *)(prevRow + x));
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) == 0xFFFF) { x += 4; continue; }
+                }
+            #endif
+            uint32_t cell = row[x];
+            if (glyphOf(cell) == WIDE_TAIL_GLYPH || !differs(x)) { x++; continue; }
+
+            detail::moveCursor(out, st, x, y);
+            detail::setColors<Model>(out, st, palette[cell >> 16 & 0xFF], palette[cell >> 24]);
+            char32_t ch = glyphOf(cell);
+            if (x + 1 < width && glyphOf(row[x + 1]) == WIDE_TAIL_GLYPH) {
+                const detail::GlyphBytes &glyph = glyphs.bytes(ch);
+                out.append(glyph.bytes, glyph.len);
+                st.cursorX = (x + 2 >= width) ? -1 : x + 2;
+                x += 2;
+                continue;
+            }
+
+            int run = 1;
+            while (x + run < width && row[x + run] == cell && differs(x + run)) run++;
+            detail::emitRun(out, st, caps, glyphs.bytes(ch), ch == U' ', run, width);
+            x += run;
+        }
+        memcpy(prevRow, row, width * sizeof(uint32_t));
+    }
+
+    inline void put(int x, int y, uint32_t cell) {
+        if (x < 0 || x >= width || y < 0 || y >= height) return;
+        uint32_t *row = &cells[(size_t)y * width];
+        // Non lasciare meta' di un glifo largo
+        if ((row[x] & 0xFFFF) == WIDE_TAIL_GLYPH && x > 0)
+            row[x - 1] = (row[x - 1] & 0xFFFF0000) | U' ';
+        else if (x + 1 < width && (row[x + 1] & 0xFFFF) == WIDE_TAIL_GLYPH && (cell & 0xFFFF) != WIDE_TAIL_GLYPH)
+            row[x + 1] = (row[x + 1] & 0xFFFF0000) | U' ';
+        row[x] = cell;
+    }
+};
+
+// Layer functions
+inline void createLayer(const string &name, int z = 0) { console().createLayer(name, z); }
+inline void removeLayer(const string &name) { console().removeLayer(name); }
+inline void setLayer(const string &name) { console().setLayer(name); }
+inline void resetLayer() { console().setLayer(""); }
+inline void setLayerZ(const string &name, int z) { console().setLayerZ(name, z); }
+inline void setLayerVisible(const string &name, bool visible) { console().setLayerVisible(name, visible); }
+inline void setLayerOpacity(const string &name, int opacity) { console().setLayerOpacity(name, opacity); }
+inline void setDrawAlpha(int alpha) { console().setDrawAlpha(alpha); }
+
+// Input functions
+inline void updateInput() { console().updateInput(); }
+inline bool keyPressed() { return console().isKeyPressed(); }
+inline int getKey() { return console().popKey(); }
+inline bool isKeyDown(int key) { return console().isKeyDown(key); }
+inline bool isKeyJustPressed(int key) { return console().isKeyJustPressed(key); }
+inline bool isKeyJustReleased(int key) { return console().isKeyJustReleased(key); }
+inline bool enableKeyEvents(bool on = true) { return console().enableKeyEvents(on); }
+inline bool keyEventsEnabled() { return console().keyEventsEnabled(); }
+
+inline int getMouseX() { return console().getMouseX(); }
+inline int getMouseY() { return console().getMouseY(); }
+inline bool isMouseButtonDown(int b = 0) { return console().isMouseButtonDown(b); }
+inline bool isMouseButtonPressed(int b = 0) { return console().isMouseButtonPressed(b); }
+inline bool isMouseButtonReleased(int b = 0) { return console().isMouseButtonReleased(b); }
+
+inline bool isMouseInArea(int x1, int y1, int x2, int y2) {
+    int mx = getMouseX(), my = getMouseY();
+    return mx >= x1 && mx <= x2 && my >= y1 && my <= y2;
+}
+
+inline bool isMouseAtPosition(int x, int y) {
+    return getMouseX() == x && getMouseY() == y;
+}
+
+// Utility functions
+inline void sleepMs(int ms) {
+    #ifdef OS_WINDOWS
+        if (ms > 0) {
+            Sleep((float)ms/2.f);
+        }
+    #else
+        if (ms > 0) {
+            usleep(ms * 1000); // usleep uses microseconds
+        }
+    #endif
+}
+
+static inline double getTime() {
+    #ifdef OS_WINDOWS
+        static LARGE_INTEGER freq, start;
+        static int init = 0;
+        LARGE_INTEGER now;
+        if (!init) { QueryPerformanceFrequency(&freq); QueryPerformanceCounter(&start); init = 1; }
+        QueryPerformanceCounter(&now);
+        return (now.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+    #else
+        static struct timespec start;
+        static int init = 0;
+        struct timespec now;
+        if (!init) { clock_gettime(CLOCK_MONOTONIC, &start); init = 1; }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    #endif
+}
+
+inline string *advancedInput(string initialValue, function<void(string &, int &, Key)> onChange = nullptr)
+{
+    string buffer = initialValue;
+    int cursorPos = initialValue.size();
+    Key latestKey;
+
+    // Il cursore e' un offset in byte ma si muove per code point: mai a meta' di un
+    // carattere UTF-8 del valore iniziale
+    auto previous = [&](int pos) {
+        do pos--; while (pos > 0 && ((unsigned char)buffer[pos] & 0xC0) == 0x80);
+        return pos;
+    };
+    auto next = [&](int pos) {
+        do pos++; while (pos < (int)buffer.size() && ((unsigned char)buffer[pos] & 0xC0) == 0x80);
+        return pos;
+    };
+
+    if (onChange)
+    {
+        onChange(buffer, cursorPos, (Key)-1);
+    }
+
+    while (true)
+    {
+        updateInput();
+        if (!keyPressed())
+        {
+            sleepMs(16); // 60 fps
+            continue;
+        }
+
+        int key = getKey();
+        latestKey = (Key)key;
+
+        switch (key)
+        {
+        case KEY_ENTER:
+            return new string(buffer);
+        case KEY_BACKSPACE:
+            if (cursorPos > 0)
+            {
+                int start = previous(cursorPos);
+                buffer.erase(start, cursorPos - start);
+                cursorPos = start;
+            }
+            break;
+        case KEY_ESC:
+            return nullptr;
+        case KEY_LEFT:
+            if (cursorPos > 0)
+                cursorPos = previous(cursorPos);
+            break;
+        case KEY_RIGHT:
+            if (cursorPos < buffer.size())
+                cursorPos = next(cursorPos);
+            break;
+        case KEY_DELETE:
+            if (cursorPos < buffer.size())
+                buffer.erase(cursorPos, next(cursorPos) - cursorPos);
+            break;
+        default:
+            if (key >= 32 && key <= 126)
+            {
+                buffer.insert(buffer.begin() + cursorPos, key);
+                cursorPos++;
+            }
+            break;
+        }
+
+        if (onChange)
+        {
+            onChange(buffer, cursorPos, latestKey);
+        }
+    }
+}
+
+// ==== Drawing functions ====
+
+// @deprecated (use pixelMode instead)
+inline void writePixel(int x, int y, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c1 = (char)219, char c2 = (char)219) {
+    bool pixelMode = isInPixelMode();
+    setPixelMode(false);
+    write(x * 2, y, c1, fg, bg);
+    write(x * 2 + 1, y, c2, fg, bg);
+    setPixelMode(pixelMode);
+}
+
+// Riga orizzontale da x1 a x2 (inclusi), rispetta pixelMode
+inline void writeSpan(int x1, int x2, int y, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (isInPixelMode())
+        DefaultPixelConsole().fillSpan(x1, x2, y, detail::cp437ToCodepoint(c), fg, bg);
+    else
+        DefaultConsole().fillSpan(x1, x2, y, detail::cp437ToCodepoint(c), fg, bg);
+}
+
+// Come writeSpan ma sempre in coordinate pixel (due celle per pixel), come writePixel
+inline void writePixelSpan(int x1, int x2, int y, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    DefaultPixelConsole().fillSpan(x1, x2, y, detail::cp437ToCodepoint(c), fg, bg);
+}
+
+inline void writeRectangle(int x1, int y1, int x2, int y2, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (x1 > x2) swap(x1, x2);
+    if (y1 > y2) swap(y1, y2);
+
+    for (int j = y1; j <= y2; ++j)
+        writeSpan(x1, x2, j, c, fg, bg);
+}
+
+inline void writeBox(int x1, int y1, int x2, int y2, bool singleLine = false, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (x1 > x2) swap(x1, x2);
+    if (y1 > y2) swap(y1, y2);
+
+    for (int i = x1 + 1; i < x2; ++i) {
+        write(i, y1, singleLine ? U'─' : U'═', fg, bg);
+        write(i, y2, singleLine ? U'─' : U'═', fg, bg);
+    }
+    for (int i = y1 + 1; i < y2; ++i) {
+        write(x1, i, singleLine ? U'│' : U'║', fg, bg);
+        write(x2, i, singleLine ? U'│' : U'║', fg, bg);
+    }
+
+    write(x1, y1, singleLine ? U'┌' : U'╔', fg, bg); // top-left
+    write(x1, y2, singleLine ? U'└' : U'╚', fg, bg); // bottom-left
+    write(x2, y1, singleLine ? U'┐' : U'╗', fg, bg); // top-right
+    write(x2, y2, singleLine ? U'┘' : U'╝', fg, bg); // bottom-right
+}
+
+inline void writeLine(int x1, int y1, int x2, int y2, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    int dx = abs(x2 - x1);
+    int dy = abs(y2 - y1);
+    int sx = (x1 < x2) ? 1 : -1;
+    int sy = (y1 < y2) ? 1 : -1;
+    int err = dx - dy;
+
+    while (true) {
+        write(x1, y1, c, fg, bg);
+        if (x1 == x2 && y1 == y2)
+            break;
+        int e2 = 2 * err;
+        if (e2 > -dy) {
+            err -= dy;
+            x1 += sx;
+        }
+        if (e2 < dx) {
+            err += dx;
+            y1 += sy;
+        }
+    }
+}
+
+namespace detail {
+    // Il piu' grande h >= 0 tale che h*h <= n (-1 se n < 0)
+    inline int isqrt(long long n) {
+        if (n < 0) return -1;
+        long long h = (long long)sqrt((double)n);
+        while (h * h > n) h--;
+        while ((h + 1) * (h + 1) <= n) h++;
+        return (int)h;
+    }
+}
+
+// Le celle con r <= distanza < r + 1, una o due span per riga
+inline void writeCircleOutline(int x, int y, int r, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) {
+    if (r < 0) return;
+    long long outer = (long long)(r + 1) * (r + 1);
+    long long inner = (long long)r * r;
+    for (int dy = -r; dy <= r; dy++) {
+        long long dy2 = (long long)dy * dy;
+        int hwOut = detail::isqrt(outer - dy2 - 1);
+        int hwIn = detail::isqrt(inner - dy2 - 1);
+        if (hwIn < 0) {
+            writePixelSpan(x - hwOut, x + hwOut, y + dy, c, fg, bg);
+        } else {
+            writePixelSpan(x - hwOut, x - hwIn - 1, y + dy, c, fg, bg);
+            writePixelSpan(x + hwIn + 1, x + hwOut, y + dy, c, fg, bg);
+        }
+    }
+}
+
+// Le celle con distanza intera <= r, una span per riga
+inline void writeCircleFilled(int x, int y, float r, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) {
+    if (r < 0) return;
+    long long R = (long long)r + 1;
+    for (int dy = -(int)R + 1; dy <= R - 1; dy++) {
+        int hw = detail::isqrt(R * R - (long long)dy * dy - 1);
+        writePixelSpan(x - hw, x + hw, y + dy, c, fg, bg);
+    }
+}
+
+// Ellisse piena in coordinate pixel, come writeCircleFilled
+inline void writeEllipseFilled(int x, int y, float rx, float ry, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) {
+    if (rx < 0 || ry <= 0) return;
+    int maxDy = (int)ry;
+    for (int dy = -maxDy; dy <= maxDy; dy++) {
+        float t = 1.f - (float)(dy * dy) / (ry * ry);
+        int hw = (int)(rx * sqrt(max(t, 0.f)));
+        writePixelSpan(x - hw, x + hw, y + dy, c, fg, bg);
+    }
+}
+
+// Le forme piene da qui in giu' sono in coordinate pixel (due celle per pixel) come i
+// cerchi, con o senza pixelMode, cosi' si possono mescolare alla stessa scala
+
+// Poligono convesso: per ogni riga prende il minimo e il massimo delle intersezioni con i lati
+inline void writePolygonFilled(const vector<pair<int, int>> &points, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (points.empty()) return;
+
+    int minY = points[0].second, maxY = points[0].second;
+    for (const auto &p : points) {
+        minY = min(minY, p.second);
+        maxY = max(maxY, p.second);
+    }
+    minY = max(minY, 0);
+    maxY = min(maxY, terminalHeight() - 1);
+
+    size_t n = points.size();
+    for (int y = minY; y <= maxY; y++) {
+        float left = INFINITY, right = -INFINITY;
+        for (size_t i = 0; i < n; i++) {
+            auto [ax, ay] = points[i];
+            auto [bx, by] = points[(i + 1) % n];
+            if (y < min(ay, by) || y > max(ay, by)) continue;
+            if (ay == by) {
+                left = min(left, (float)min(ax, bx));
+                right = max(right, (float)max(ax, bx));
+            } else {
+                float ix = ax + (float)(y - ay) * (bx - ax) / (float)(by - ay);
+                left = min(left, ix);
+                right = max(right, ix);
+            }
+        }
+        if (left <= right)
+            writePixelSpan((int)lround(left), (int)lround(right), y, c, fg, bg);
+    }
+}
+
+inline void writeTriangleFilled(int x1, int y1, int x2, int y2, int x3, int y3, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    writePolygonFilled({{x1, y1}, {x2, y2}, {x3, y3}}, c, fg, bg);
+}
+
+// Rettangolo pieno con gli angoli arrotondati di raggio radius
+inline void writeRoundedBox(int x1, int y1, int x2, int y2, int radius, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+    if (x1 > x2) swap(x1, x2);
+    if (y1 > y2) swap(y1, y2);
+    radius = max(0, min(radius, min((x2 - x1) / 2, (y2 - y1) / 2)));
+
+    for (int j = y1; j <= y2; j++) {
+        int k = min(j - y1, y2 - j); // distanza dal bordo orizzontale piu' vicino
+        int inset = 0;
+        if (k < radius) {
+            int d = radius - k;
+            inset = radius - detail::isqrt((long long)radius * radius - (long long)d * d);
+        }
+        writePixelSpan(x1 + inset, x2 - inset, j, c, fg, bg);
+    }
+}
+
+inline Color randColor() {
+    uint64_t r = pwetty::rng().next();
+    return Color((int)(r & 255), (int)(r >> 8 & 255), (int)(r >> 16 & 255));
+}
+
+// ======================== VIEWS ========================
+namespace pwetty {
+    // Finestra su una parte dello schermo: origine e clip in celle, coordinate locali
+    // (in pixel se pixelMode). Non ha buffer propri: mentre disegna sposta e ritaglia
+    // le scritture della console, che finiscono direttamente nelle celle condivise
+    // (o nel layer attivo). Costa quanto un rettangolo, si puo' creare ad ogni frame.
+    class View {
+    public:
+        View() : View(0, 0, terminalWidth(), terminalHeight()) {}
+
+        View(int x, int y, int w, int h, bool pixelMode = false)
+            : originX(x), originY(y), w(max(0, w)), h(max(0, h)), pixelMode(pixelMode) {
+            clip = {x, y, x + this->w, y + this->h};
+        }
+
+        // Sotto-vista in coordinate locali (celle, o pixel se questa vista e' in pixelMode),
+        // ritagliata sui bordi di questa
+        View sub(int x, int y, int subW, int subH, bool subPixelMode = false) const {
+            int cx = pixelMode ? 2 : 1;
+            View v(originX + x * cx, originY + y, subW * (subPixelMode ? 2 : 1), subH, subPixelMode);
+            v.clip = {max(v.clip.x1, clip.x1), max(v.clip.y1, clip.y1),
+                      min(v.clip.x2, clip.x2), min(v.clip.y2, clip.y2)};
+            return v;
+        }
+
+        int getX() const { return originX; }
+        int getY() const { return originY; }
+        int getWidth() const { return pixelMode ? w / 2 : w; }
+        int getHeight() const { return h; }
+        bool isInPixelMode() const { return pixelMode; }
+        void setPixelMode(bool state) { pixelMode = state; }
+
+        // Esegue fn con la vista applicata: tutte le funzioni di disegno (anche widget e
+        // codice dell'app) scrivono in coordinate locali e non escono dal clip
+        template <class Fn>
+        void draw(Fn &&fn) const {
+            Scope scope(*this);
+            fn();
+        }
+
+        void clear(Color bg = DEFAULT_BG) const {
+            Scope scope(*this);
+            for (int j = 0; j < h; j++)
+                console().fillSpan(0, w - 1, j, U' ', DEFAULT_FG, bg);
+        }
+
+        void write(int x, int y, char c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const { draw([&] { ::write(x, y, c, fg, bg); }); }
+        void write(int x, int y, char32_t c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const { draw([&] { ::write(x, y, c, fg, bg); }); }
+        void write(int x, int y, string_view text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const { draw([&] { ::write(x, y, text, fg, bg); }); }
+        void writeAligned(Alignment align, int y, string_view text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeAligned(align, y, text, fg, bg); });
+        }
+
+        template <class... Args>
+        void writef(int x, int y, Color fg, Color bg, string_view fmt, const Args &...args) const {
+            draw([&] { ::writef(x, y, fg, bg, fmt, args...); });
+        }
+        template <class... Args>
+        void writef(int x, int y, string_view fmt, const Args &...args) const {
+            draw([&] { ::writef(x, y, fmt, args...); });
+        }
+
+        void writeSpan(int x1, int x2, int y, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeSpan(x1, x2, y, c, fg, bg); });
+        }
+        void writeRectangle(int x1, int y1, int x2, int y2, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeRectangle(x1, y1, x2, y2, c, fg, bg); });
+        }
+        void writeBox(int x1, int y1, int x2, int y2, bool singleLine = false, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeBox(x1, y1, x2, y2, singleLine, fg, bg); });
+        }
+        void writeLine(int x1, int y1, int x2, int y2, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeLine(x1, y1, x2, y2, c, fg, bg); });
+        }
+        void writeCircleOutline(int x, int y, int r, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) const {
+            draw([&] { ::writeCircleOutline(x, y, r, fg, bg, c); });
+        }
+        void writeCircleFilled(int x, int y, float r, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) const {
+            draw([&] { ::writeCircleFilled(x, y, r, fg, bg, c); });
+        }
+        void writeEllipseFilled(int x, int y, float rx, float ry, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) const {
+            draw([&] { ::writeEllipseFilled(x, y, rx, ry, fg, bg, c); });
+        }
+        void writePolygonFilled(const vector<pair<int, int>> &points, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writePolygonFilled(points, c, fg, bg); });
+        }
+        void writeTriangleFilled(int x1, int y1, int x2, int y2, int x3, int y3, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeTriangleFilled(x1, y1, x2, y2, x3, y3, c, fg, bg); });
+        }
+        void writeRoundedBox(int x1, int y1, int x2, int y2, int radius, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) const {
+            draw([&] { ::writeRoundedBox(x1, y1, x2, y2, radius, c, fg, bg); });
+        }
+
+    private:
+        int originX, originY, w, h;
+        detail::Rect clip;
+        bool pixelMode;
+
+        // Applica la vista e ripristina lo stato precedente (anche un'altra vista)
+        struct Scope {
+            detail::ViewState saved;
+            bool savedPixelMode;
+
+            explicit Scope(const View &v) : saved(console().getViewState()), savedPixelMode(::isInPixelMode()) {
+                detail::ViewState state;
+                state.active = true;
+                state.originX = v.originX;
+                state.originY = v.originY;
+                state.w = v.w;
+                state.h = v.h;
+                state.clip = v.clip;
+                // Una vista dentro un'altra non esce dal clip di quella esterna
+                if (saved.active)
+                    state.clip = {max(state.clip.x1, saved.clip.x1), max(state.clip.y1, saved.clip.y1),
+                                  min(state.clip.x2, saved.clip.x2), min(state.clip.y2, saved.clip.y2)};
+                console().setViewState(state);
+                ::setPixelMode(v.pixelMode);
+            }
+
+            ~Scope() {
+                console().setViewState(saved);
+                ::setPixelMode(savedPixelMode);
+            }
+        };
+    };
+}
+
+// ======================== IMAGES ========================
+namespace pwetty {
+    // Pixel RGBA contigui, 4 byte per pixel
+    struct ImageLevel {
+        int width = 0, height = 0;
+        vector<uint8_t> rgba;
+
+        const uint8_t *pixel(int x, int y) const { return &rgba[((size_t)y * width + x) * 4]; }
+        Color at(int x, int y) const {
+            const uint8_t *p = pixel(x, y);
+            return Color(p[0], p[1], p[2]);
+        }
+        uint8_t alphaAt(int x, int y) const { return pixel(x, y)[3]; }
+    };
+
+    // Immagine decodificata una volta sola. Per disegnarla piccola si parte dalla catena
+    // di mip (ogni livello e' la media 2x2 del precedente, creato al primo uso) e si
+    // tengono pronte le ultime dimensioni richieste, rifatte solo quando cambiano (resize
+    // del terminale): disegnare e' una copia diretta. Mip e versioni ridotte si creano
+    // sotto un mutex, quindi la stessa immagine si puo' disegnare da piu' thread.
+    class Image {
+    public:
+        // Dimensioni diverse tenute pronte da fit()
+        static const int FIT_CACHE = 4;
+
+        Image() = default;
+
+        Image(int w, int h, const uint8_t *rgba) : derived(make_shared<Derived>()) {
+            derived->levels.resize(1);
+            ImageLevel &base = derived->levels[0];
+            base.width = w;
+            base.height = h;
+            base.rgba.assign(rgba, rgba + (size_t)w * h * 4);
+            static atomic<uint64_t> nextId{0};
+            id = ++nextId;
+        }
+
+        bool empty() const { return !derived || base().width <= 0 || base().height <= 0; }
+        int getWidth() const { return empty() ? 0 : base().width; }
+        int getHeight() const { return empty() ? 0 : base().height; }
+        Color at(int x, int y) const { return base().at(x, y); }
+        // Le immagini non cambiano dopo la creazione: l'id identifica il contenuto
+        uint64_t contentId() const { return id; }
+
+        // Livelli fino a 1x1
+        int mipCount() const {
+            int n = 1;
+            for (int w = getWidth(), h = getHeight(); w > 1 || h > 1; w = max(1, w / 2), h = max(1, h / 2)) n++;
+            return empty() ? 0 : n;
+        }
+
+        // I livelli restano validi quanto l'immagine
+        const ImageLevel &mip(int i) const {
+            lock_guard<mutex> guard(derived->lock);
+            return mipLocked(i);
+        }
+
+        // L'immagine a w x h: media dei pixel coperti da ogni cella (box filter) presa dal
+        // mip piu' piccolo che e' ancora grande almeno w x h. Si tengono le ultime
+        // FIT_CACHE dimensioni: il riferimento resta valido finche' non se ne chiedono
+        // FIT_CACHE diverse.
+        const ImageLevel &fit(int w, int h) const {
+            static const ImageLevel none;
+            if (empty()) return none;
+            w = max(1, w);
+            h = max(1, h);
+
+            lock_guard<mutex> guard(derived->lock);
+            list<ImageLevel> &fitted = derived->fitted;
+            for (auto it = fitted.begin(); it != fitted.end(); ++it) {
+                if (it->width == w && it->height == h) {
+                    fitted.splice(fitted.begin(), fitted, it);
+                    return fitted.front();
+                }
+            }
+
+            int level = 0;
+            while (level + 1 < mipCount()) {
+                const ImageLevel &next = mipLocked(level + 1);
+                if (next.width < w || next.height < h) break;
+                level++;
+            }
+            const ImageLevel &src = mipLocked(level);
+
+            ImageLevel out;
+            out.width = w;
+            out.height = h;
+            out.rgba.resize((size_t)w * h * 4);
+            for (int y = 0; y < h; y++) {
+                int sy0 = (int)((long long)y * src.height / h);
+                int sy1 = max(sy0 + 1, (int)((long long)(y + 1) * src.height / h));
+                for (int x = 0; x < w; x++) {
+                    int sx0 = (int)((long long)x * src.width / w);
+                    int sx1 = max(sx0 + 1, (int)((long long)(x + 1) * src.width / w));
+                    unsigned sum[4] = {0, 0, 0, 0};
+                    for (int sy = sy0; sy < sy1; sy++)
+                        for (int sx = sx0; sx < sx1; sx++) {
+                            const uint8_t *p = src.pixel(sx, sy);
+                            for (int k = 0; k < 4; k++) sum[k] += p[k];
                         }
+                    unsigned n = (unsigned)((sy1 - sy0) * (sx1 - sx0));
+                    uint8_t *dst = &out.rgba[((size_t)y * w + x) * 4];
+                    for (int k = 0; k < 4; k++) dst[k] = (uint8_t)((sum[k] + n / 2) / n);
+                }
+            }
+            fitted.push_front(move(out));
+            if ((int)fitted.size() > FIT_CACHE) fitted.pop_back();
+            return fitted.front();
+        }
+
+    private:
+        // Dati derivati, creati al primo uso. Condivisi dalle copie (il contenuto non
+        // cambia); deque e list non spostano gli elementi gia' creati.
+        struct Derived {
+            mutex lock;
+            deque<ImageLevel> levels; // levels[0] e' l'originale
+            list<ImageLevel> fitted;  // la dimensione usata piu' di recente per prima
+        };
+        shared_ptr<Derived> derived;
+        uint64_t id = 0;
+
+        // Il livello 0 non cambia mai: si legge senza lock
+        const ImageLevel &base() const { return derived->levels.front(); }
+
+        const ImageLevel &mipLocked(int i) const {
+            deque<ImageLevel> &levels = derived->levels;
+            i = max(0, min(i, mipCount() - 1));
+            while ((int)levels.size() <= i) {
+                const ImageLevel &src = levels.back();
+                ImageLevel next;
+                next.width = max(1, src.width / 2);
+                next.height = max(1, src.height / 2);
+                next.rgba.resize((size_t)next.width * next.height * 4);
+                for (int y = 0; y < next.height; y++)
+                    for (int x = 0; x < next.width; x++) {
+                        int x0 = min(x * 2, src.width - 1), x1 = min(x * 2 + 1, src.width - 1);
+                        int y0 = min(y * 2, src.height - 1), y1 = min(y * 2 + 1, src.height - 1);
+                        const uint8_t *a = src.pixel(x0, y0), *b = src.pixel(x1, y0);
+                        const uint8_t *c = src.pixel(x0, y1), *d = src.pixel(x1, y1);
+                        uint8_t *out = &next.rgba[((size_t)y * next.width + x) * 4];
+                        for (int k = 0; k < 4; k++)
+                            out[k] = (uint8_t)((a[k] + b[k] + c[k] + d[k] + 2) / 4);
                     }
+                levels.push_back(move(next));
+            }
+            return levels[i];
+        }
+    };
+
+    // Disegna l'immagine nel rettangolo (x, y, w, h), in pixel se pixelMode.
+    // I pixel con alpha < 128 lasciano la cella com'e'.
+    inline void drawImage(const Image &image, int x, int y, int w, int h) {
+        if (image.empty() || w <= 0 || h <= 0) return;
+        const ImageLevel &level = image.fit(w, h);
+        shade(x, y, x + w - 1, y + h - 1, [&](int px, int py) {
+            int ix = px - x, iy = py - y;
+            if (level.alphaAt(ix, iy) < 128) return Cell{0, CLEAR, CLEAR};
+            return Cell{U' ', DEFAULT_FG, level.at(ix, iy)};
+        });
+    }
+
+    // Tutto lo schermo (o la View attiva)
+    inline void drawImage(const Image &image) { drawImage(image, 0, 0, terminalWidth(), terminalHeight()); }
+
+}
+
+// ======================== SPRITES ========================
+namespace pwetty {
+    // Bitmap di celle (glifo e colori) da disegnare ruotata e scalata. Una cella
+    // {0, CLEAR, CLEAR} e' trasparente; ch == 0 da solo lascia il glifo sotto.
+    class Sprite {
+    public:
+        Sprite() = default;
+        Sprite(int w, int h, Cell fill = Cell{0, CLEAR, CLEAR})
+            : width(max(w, 0)), height(max(h, 0)), cells((size_t)max(w, 0) * max(h, 0), fill),
+              pivotX(max(w, 0) / 2.f), pivotY(max(h, 0) / 2.f) {}
+
+        // Una riga di testo per riga dello sprite; gli spazi sono trasparenti
+        static Sprite fromText(const vector<string> &lines, Color fg = DEFAULT_FG, Color bg = CLEAR) {
+            vector<u32string> rows;
+            int w = 0;
+            for (const string &line : lines) {
+                u32string row;
+                for (const char *p = line.data(), *end = p + line.size(); p < end;)
+                    row += detail::decodeUtf8(p, end);
+                w = max(w, (int)row.size());
+                rows.push_back(move(row));
+            }
+            Sprite sprite(w, (int)rows.size());
+            for (int y = 0; y < sprite.height; y++)
+                for (int x = 0; x < (int)rows[y].size(); x++)
+                    if (rows[y][x] != U' ') sprite.at(x, y) = Cell{rows[y][x], fg, bg};
+            return sprite;
+        }
+
+        // Un pixel per cella come sfondo; alpha < 128 resta trasparente
+        static Sprite fromImage(const ImageLevel &level) {
+            Sprite sprite(level.width, level.height);
+            for (int y = 0; y < level.height; y++)
+                for (int x = 0; x < level.width; x++)
+                    if (level.alphaAt(x, y) >= 128) sprite.at(x, y) = Cell{U' ', DEFAULT_FG, level.at(x, y)};
+            return sprite;
+        }
+
+        int getWidth() const { return width; }
+        int getHeight() const { return height; }
+        bool empty() const { return width == 0 || height == 0; }
+        Cell &at(int x, int y) { return cells[(size_t)y * width + x]; }
+        const Cell &at(int x, int y) const { return cells[(size_t)y * width + x]; }
+
+        // Punto dello sprite (in celle) che finisce in (x, y) e attorno a cui ruota.
+        // Di default il centro.
+        void setPivot(float x, float y) { pivotX = x; pivotY = y; }
+        float getPivotX() const { return pivotX; }
+        float getPivotY() const { return pivotY; }
+
+    private:
+        int width = 0, height = 0;
+        vector<Cell> cells;
+        float pivotX = 0, pivotY = 0;
+    };
+
+    // Disegna lo sprite col pivot in (x, y), ruotato di angle radianti e scalato di scale.
+    // Mappatura inversa: per ogni riga del rettangolo che contiene lo sprite trasformato
+    // si calcolano la prima cella sorgente e il passo in 16.16, poi ogni cella costa due
+    // somme intere. Fuori pixelMode le celle sono alte il doppio che larghe: la rotazione
+    // avviene nello spazio fisico, cosi' la forma non si deforma girando.
+    inline void drawTransformed(const Sprite &sprite, float x, float y, float angle, float scale = 1.f) {
+        if (sprite.empty() || !(fabs(scale) > 1e-4f)) return;
+        detail::Console &c = console();
+        int cx = c.isInPixelMode() ? 2 : 1;
+        float aspect = c.isInPixelMode() ? 1.f : 2.f;
+        float cs = cos(angle), sn = sin(angle);
+        float px = sprite.getPivotX(), py = sprite.getPivotY();
+        int w = sprite.getWidth(), h = sprite.getHeight();
+
+        // Rettangolo che contiene i quattro angoli trasformati, tagliato allo schermo
+        float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f;
+        for (int k = 0; k < 4; k++) {
+            float ox = ((k & 1) ? w : 0) - px;
+            float oy = (((k & 2) ? h : 0) - py) * aspect;
+            float tx = x + (ox * cs - oy * sn) * scale;
+            float ty = y + (ox * sn + oy * cs) * scale / aspect;
+            minX = min(minX, tx); maxX = max(maxX, tx);
+            minY = min(minY, ty); maxY = max(maxY, ty);
+        }
+        int x1 = max((int)floor(minX), 0), x2 = min((int)ceil(maxX), terminalWidth() - 1);
+        int y1 = max((int)floor(minY), 0), y2 = min((int)ceil(maxY), terminalHeight() - 1);
+        if (x1 > x2 || y1 > y2) return;
+
+        // Passi della sorgente per una cella a destra e per una riga in basso
+        const float ONE = 65536.f;
+        float dudx = cs / scale, dvdx = -sn / (aspect * scale);
+        float dudy = aspect * sn / scale, dvdy = cs / scale;
+        int32_t stepU = (int32_t)lround(dudx * ONE), stepV = (int32_t)lround(dvdx * ONE);
+
+        for (int row = y1; row <= y2; row++) {
+            // Centro della prima cella della riga
+            float ox = x1 + 0.5f - x, oy = row + 0.5f - y;
+            float u = px + ox * dudx + oy * dudy;
+            float v = py + ox * dvdx + oy * dvdy;
+
+            // Solo le colonne in cui la sorgente cade dentro lo sprite (un margine di una
+            // cella per gli arrotondamenti: il controllo nel ciclo fa il resto)
+            float lo = 0, hi = (float)(x2 - x1);
+            auto limit = [&](float start, float step, int size) {
+                if (fabs(step) < 1e-9f) {
+                    if (start < 0 || start >= size) hi = -1;
+                    return;
+                }
+                float a = (0 - start) / step, b = (size - start) / step;
+                if (a > b) swap(a, b);
+                lo = max(lo, floor(a) - 1);
+                hi = min(hi, ceil(b) + 1);
+            };
+            limit(u, dudx, w);
+            limit(v, dvdx, h);
+            if (lo > hi) continue;
+
+            int first = x1 + (int)lo, last = x1 + (int)hi;
+            int32_t fu = (int32_t)lround((u + lo * dudx) * ONE);
+            int32_t fv = (int32_t)lround((v + lo * dvdx) * ONE);
+            for (int col = first; col <= last; col++, fu += stepU, fv += stepV) {
+                int sx = fu >> 16, sy = fv >> 16;
+                if ((unsigned)sx >= (unsigned)w || (unsigned)sy >= (unsigned)h) continue;
+                const Cell &cell = sprite.at(sx, sy);
+                if (!cell.ch && cell.fg == CLEAR && cell.bg == CLEAR) continue;
+                // Una cella sola per glifo, come in shade()
+                char32_t ch = (cell.ch >= 0x300 && detail::computeGlyphWidth(cell.ch) != 1) ? U' ' : cell.ch;
+                for (int k = 0; k < cx; k++) {
+                    int screenX = col * cx + k;
+                    c.putCell(screenX, row, ch ? ch : c.cellAt(screenX, row), cell.fg, cell.bg);
+                }
+            }
+        }
+    }
+}
+
+// ======================== GRAPHICS PROTOCOLS ========================
+namespace detail {
+    // Palette di al massimo maxColors colori per una regione dell'immagine (median cut):
+    // istogramma su 15 bit (5 per canale), poi la scatola di colori piu' estesa si divide
+    // a meta' dei pixel lungo il suo canale piu' lungo finche' le scatole non bastano.
+    // Ogni scatola diventa la media dei suoi pixel.
+    struct ReducedPalette {
+        vector<Color> colors;
+        vector<uint8_t> lookup; // indice nella palette per ogni chiave a 15 bit
+
+        static int key(const uint8_t *p) { return (p[0] >> 3) << 10 | (p[1] >> 3) << 5 | (p[2] >> 3); }
+        int index(const uint8_t *p) const { return lookup[key(p)]; }
+    };
+
+    inline ReducedPalette reducePalette(const pwetty::ImageLevel &img, int sx, int sy, int sw, int sh, int maxColors) {
+        vector<uint32_t> count(32768, 0);
+        vector<array<uint32_t, 3>> sum(32768, {0, 0, 0});
+        for (int y = sy; y < sy + sh; y++)
+            for (int x = sx; x < sx + sw; x++) {
+                const uint8_t *p = img.pixel(x, y);
+                if (p[3] < 128) continue;
+                int k = ReducedPalette::key(p);
+                count[k]++;
+                sum[k][0] += p[0]; sum[k][1] += p[1]; sum[k][2] += p[2];
+            }
+
+        vector<int> used;
+        for (int k = 0; k < 32768; k++)
+            if (count[k]) used.push_back(k);
+        auto channel = [](int k, int c) { return (k >> (10 - 5 * c)) & 31; };
+
+        struct Box { int begin, end, axis, range; };
+        auto measure = [&](Box &box) {
+            int lo[3] = {31, 31, 31}, hi[3] = {0, 0, 0};
+            for (int i = box.begin; i < box.end; i++)
+                for (int c = 0; c < 3; c++) {
+                    lo[c] = min(lo[c], channel(used[i], c));
+                    hi[c] = max(hi[c], channel(used[i], c));
                 }
+            box.axis = 0;
+            for (int c = 1; c < 3; c++)
+                if (hi[c] - lo[c] > hi[box.axis] - lo[box.axis]) box.axis = c;
+            box.range = box.end - box.begin > 1 ? hi[box.axis] - lo[box.axis] : 0;
+        };
+
+        vector<Box> boxes;
+        if (!used.empty()) {
+            boxes.push_back({0, (int)used.size(), 0, 0});
+            measure(boxes[0]);
+        }
+        while ((int)boxes.size() < maxColors) {
+            int widest = -1;
+            for (int i = 0; i < (int)boxes.size(); i++)
+                if (boxes[i].range > 0 && (widest < 0 || boxes[i].range > boxes[widest].range)) widest = i;
+            if (widest < 0) break;
+
+            Box &box = boxes[widest];
+            int axis = box.axis;
+            sort(used.begin() + box.begin, used.begin() + box.end,
+                 [&](int a, int b) { return channel(a, axis) < channel(b, axis); });
+            uint64_t total = 0, half = 0;
+            for (int i = box.begin; i < box.end; i++) total += count[used[i]];
+            int split = box.begin + 1;
+            for (int i = box.begin; i < box.end - 1; i++) {
+                half += count[used[i]];
+                split = i + 1;
+                if (half * 2 >= total) break;
             }
+            Box upper = {split, box.end, 0, 0};
+            box.end = split;
+            measure(box);
+            measure(upper);
+            boxes.push_back(upper);
+        }
 
-            bool isSequenceComplete(const string& seq) {
-                if(seq.empty()) return true;
-                if(seq[0] != '\033') return true;
-                if(seq.size() < 2) return false;
-                
-                // Mouse sequences
-                if(seq.size() >= 3 && seq[1] == '[' && seq[2] == '<') {
-                    return seq.find('M') != string::npos || seq.find('m') != string::npos;
+        ReducedPalette pal;
+        pal.lookup.assign(32768, 0);
+        for (int b = 0; b < (int)boxes.size(); b++) {
+            uint64_t n = 0, r = 0, g = 0, bl = 0;
+            for (int i = boxes[b].begin; i < boxes[b].end; i++) {
+                int k = used[i];
+                n += count[k]; r += sum[k][0]; g += sum[k][1]; bl += sum[k][2];
+                pal.lookup[k] = (uint8_t)b;
+            }
+            pal.colors.push_back(Color((int)(r / n), (int)(g / n), (int)(bl / n)));
+        }
+        return pal;
+    }
+
+    // Sixel della regione (sx, sy, sw, sh) di un'immagine grande pw x ph: palette ridotta
+    // a 255 colori, bande di 6 righe, per ogni colore della banda una riga di sixel
+    // compressa con RLE (!n). Il terminale non scala i sixel, quindi se img e' piu'
+    // piccola di pw x ph i pixel si ripetono qui: le ripetizioni finiscono nelle RLE e
+    // l'immagine grande non esiste mai in memoria. I pixel con alpha < 128 restano trasparenti.
+    inline void encodeSixel(string &out, const pwetty::ImageLevel &img, int pw, int ph, int sx, int sy, int sw, int sh) {
+        vector<int> mapX(sw), mapY(sh);
+        for (int x = 0; x < sw; x++) mapX[x] = (int)((long long)(sx + x) * img.width / pw);
+        for (int y = 0; y < sh; y++) mapY[y] = (int)((long long)(sy + y) * img.height / ph);
+        ReducedPalette pal = reducePalette(img, mapX[0], mapY[0], mapX[sw - 1] - mapX[0] + 1, mapY[sh - 1] - mapY[0] + 1, 255);
+        int colors = (int)pal.colors.size();
+
+        out += "\033P0;1;0q\"1;1;";
+        appendInt(out, sw); out += ';';
+        appendInt(out, sh);
+        for (int i = 0; i < colors; i++) {
+            const Color &c = pal.colors[i];
+            out += '#'; appendInt(out, i);
+            out += ";2;"; appendInt(out, (c.r * 100 + 127) / 255);
+            out += ';'; appendInt(out, (c.g * 100 + 127) / 255);
+            out += ';'; appendInt(out, (c.b * 100 + 127) / 255);
+        }
+
+        vector<uint8_t> bits((size_t)max(colors, 1) * sw, 0);
+        vector<char> inBand(max(colors, 1), 0);
+        vector<int> bandColors;
+        for (int y0 = 0; y0 < sh; y0 += 6) {
+            bandColors.clear();
+            for (int r = 0; r < 6 && y0 + r < sh; r++) {
+                for (int x = 0; x < sw; x++) {
+                    const uint8_t *p = img.pixel(mapX[x], mapY[y0 + r]);
+                    if (p[3] < 128) continue;
+                    int c = pal.index(p);
+                    if (!inBand[c]) { inBand[c] = 1; bandColors.push_back(c); }
+                    bits[(size_t)c * sw + x] |= (uint8_t)(1 << r);
                 }
-                
-                // CSI sequences
-                if(seq[1] == '[') {
-                    if(seq.size() >= 3) {
-                        char last = seq.back();
-                        // Sequences ending with letters or ~
-                        return (last >= 'A' && last <= 'Z') || (last >= 'a' && last <= 'z') || last == '~';
+            }
+
+            for (size_t i = 0; i < bandColors.size(); i++) {
+                int c = bandColors[i];
+                if (i) out += '$'; // torna all'inizio della banda per il colore dopo
+                out += '#'; appendInt(out, c);
+                uint8_t *row = &bits[(size_t)c * sw];
+                int end = sw;
+                while (end > 0 && row[end - 1] == 0) end--;
+                for (int x = 0; x < end;) {
+                    int run = 1;
+                    while (x + run < end && row[x + run] == row[x]) run++;
+                    char ch = (char)('?' + row[x]);
+                    if (run > 3) {
+                        out += '!'; appendInt(out, run); out += ch;
+                    } else {
+                        out.append(run, ch);
                     }
-                    return false;
+                    x += run;
                 }
-                
-                return true;
+                fill(row, row + sw, 0);
+                inBand[c] = 0;
             }
-        #endif
+            out += '-';
+        }
+        out += "\033\\";
+    }
 
-    public:
-        static Console& get() {
-            static Console instance;
-            return instance;
+    inline void appendBase64(string &out, const uint8_t *data, size_t n) {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        size_t i = 0;
+        for (; i + 2 < n; i += 3) {
+            uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+            out += table[v >> 18]; out += table[(v >> 12) & 63];
+            out += table[(v >> 6) & 63]; out += table[v & 63];
         }
+        if (i < n) {
+            uint32_t v = data[i] << 16 | (i + 1 < n ? data[i + 1] << 8 : 0);
+            out += table[v >> 18]; out += table[(v >> 12) & 63];
+            out += i + 1 < n ? table[(v >> 6) & 63] : '=';
+            out += '=';
+        }
+    }
 
-        void cleanup() {
-            resetTerminal();
-            exit(0);
+    // Immagine kitty della regione: trasmessa alla sua dimensione e mostrata su cols x rows
+    // celle senza muovere il cursore, e' il terminale a scalarla (c=, r=). RGB se e' tutta opaca, altrimenti RGBA; a pezzi da 4096 byte.
+    inline void encodeKitty(string &out, const pwetty::ImageLevel &img, int sx, int sy, int sw, int sh,
+                            int cols, int rows, int imageId, int placementId) {
+        bool opaque = true;
+        for (int y = sy; y < sy + sh && opaque; y++)
+            for (int x = sx; x < sx + sw; x++)
+                if (img.pixel(x, y)[3] != 255) { opaque = false; break; }
+
+        int channels = opaque ? 3 : 4;
+        vector<uint8_t> raw((size_t)sw * sh * channels);
+        uint8_t *dst = raw.data();
+        for (int y = sy; y < sy + sh; y++)
+            for (int x = sx; x < sx + sw; x++) {
+                memcpy(dst, img.pixel(x, y), channels);
+                dst += channels;
+            }
+        string data;
+        appendBase64(data, raw.data(), raw.size());
+
+        const size_t chunk = 4096;
+        for (size_t i = 0; i < data.size() || i == 0; i += chunk) {
+            bool more = i + chunk < data.size();
+            out += "\033_G";
+            if (i == 0) {
+                out += "a=T,f="; appendInt(out, opaque ? 24 : 32);
+                out += ",s="; appendInt(out, sw);
+                out += ",v="; appendInt(out, sh);
+                out += ",c="; appendInt(out, cols);
+                out += ",r="; appendInt(out, rows);
+                out += ",i="; appendInt(out, imageId);
+                out += ",p="; appendInt(out, placementId);
+                out += ",C=1,q=2,";
+            }
+            out += more ? "m=1;" : "m=0;";
+            out.append(data, i, min(chunk, data.size() - i));
+            out += "\033\\";
         }
+    }
+}
 
-        // ======================== INPUT UPDATE ========================
-        void updateInput() {
-            for(int i = 0; i < 8; i++) {
-                mouseButtonPressed[i] = false;
-                mouseButtonReleased[i] = false;
+namespace detail {
+    // Mette l'immagine (coordinate di drawImage) come kitty o come sixel, se costa meno
+    // che ridisegnare tutte le sue celle. false: meglio le celle, non e' stato fatto niente.
+    inline bool placeImageGraphic(const pwetty::Image &image, int x, int y, int w, int h, bool kitty) {
+        Console &c = console();
+        c.ensureSize();
+
+        if (c.pixelMode) { x *= 2; w *= 2; }
+        const ViewState &view = c.getViewState();
+        if (view.active) { x += view.originX; y += view.originY; }
+
+        // Ritaglio su schermo e vista. Un sixel sull'ultima riga farebbe scorrere il terminale.
+        Rect r = {max(x, 0), max(y, 0), min(x + w, c.width), min(y + h, c.height)};
+        if (!kitty) r.y2 = min(r.y2, c.height - 1);
+        if (view.active)
+            r = {max(r.x1, view.clip.x1), max(r.y1, view.clip.y1), min(r.x2, view.clip.x2), min(r.y2, view.clip.y2)};
+        if (r.empty()) return true;
+
+        // Pixel dell'area su schermo e dell'immagine da codificare: mai piu' grande della
+        // sorgente (ingrandire non aggiunge dettaglio, solo byte) ne' dell'area, ma almeno un
+        // pixel per cella cosi' ogni ritaglio ne ha qualcuno.
+        int cellW, cellH;
+        c.getCellPixelSize(cellW, cellH);
+        int pw = w * cellW, ph = h * cellH;
+        int lw = min(pw, max(image.getWidth(), w)), lh = min(ph, max(image.getHeight(), h));
+        // Con la qualita' adattiva le immagini calano con il resto: sono spesso la gran
+        // parte dei byte del frame
+        int quality = c.getQualityLevel();
+        lw = max(w, lw >> quality);
+        lh = max(h, lh >> quality);
+        int sx = (r.x1 - x) * cellW, sy = (r.y1 - y) * cellH;
+        int sw = (r.x2 - r.x1) * cellW, sh = (r.y2 - r.y1) * cellH;
+        // Ritaglio in pixel dell'immagine ridotta, bordi arrotondati verso l'esterno
+        int lx1 = (int)((long long)sx * lw / pw), ly1 = (int)((long long)sy * lh / ph);
+        int lx2 = (int)(((long long)(sx + sw) * lw + pw - 1) / pw);
+        int ly2 = (int)(((long long)(sy + sh) * lh + ph - 1) / ph);
+
+        GraphicPlacement g;
+        g.x = r.x1;
+        g.y = r.y1;
+        g.w = r.x2 - r.x1;
+        g.h = r.y2 - r.y1;
+        g.kitty = kitty;
+        uint64_t key = image.contentId();
+        for (int v : {pw, ph, lw, lh, sx, sy, sw, sh})
+            key = (key ^ (uint64_t)(uint32_t)v) * 0x100000001b3ull;
+        g.key = key;
+
+        // Gia' sullo schermo, o gia' nella memoria di kitty: non si ritrasmette niente
+        bool shown = any_of(c.graphicsShown.begin(), c.graphicsShown.end(),
+                            [&](const GraphicPlacement &old) { return old.sameAs(g); });
+        bool stored = kitty && find(c.kittyImages.begin(), c.kittyImages.end(), g.imageId()) != c.kittyImages.end();
+
+        // Le celle al posto dell'immagine, tutte cambiate: due colori e un glifo ciascuna
+        size_t cellBytes = (size_t)g.w * g.h * (c.getColorDepth() == ColorDepth::Color256 ? 24 : 40);
+        shared_ptr<string> payload;
+        if (!shown && !stored) {
+            if (kitty) {
+                if ((size_t)(lx2 - lx1) * (ly2 - ly1) * 4 > cellBytes) return false;
+            } else {
+                payload = make_shared<string>();
+                encodeSixel(*payload, image.fit(lw, lh), pw, ph, sx, sy, sw, sh);
+                if (payload->size() > cellBytes) return false;
             }
+        }
 
-            #ifdef OS_LINUX
-                char buf[256];
-                ssize_t n;
-                
-                while((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-                    for(ssize_t i = 0; i < n; i++) {
-                        incompleteSequence += buf[i];
-                        
-                        if(isSequenceComplete(incompleteSequence)) {
-                            if(incompleteSequence.size() > 3 && incompleteSequence[2] == '<') {
-                                parseMouseSequence(incompleteSequence);
-                            } else {
-                                parseKeySequence(incompleteSequence);
-                            }
-                            incompleteSequence.clear();
-                        }
-                    }
+        int cols = g.w, rows = g.h;
+        g.encode = [&image, payload, pw, ph, lw, lh, sx, sy, sw, sh, lx1, ly1, lx2, ly2, cols, rows, kitty](
+                       string &out, int imageId, int placementId) {
+            if (payload) {
+                out += *payload;
+                return;
+            }
+            const pwetty::ImageLevel &level = image.fit(lw, lh);
+            if (kitty)
+                encodeKitty(out, level, lx1, ly1, lx2 - lx1, ly2 - ly1, cols, rows, imageId, placementId);
+            else
+                encodeSixel(out, level, pw, ph, sx, sy, sw, sh);
+        };
+        c.placeGraphic(move(g));
+        return true;
+    }
+}
 
-                    // Prevent infinite loop if we keep getting data
-                    if(n < (ssize_t)sizeof(buf)) break;
-                }
-            #endif
+namespace pwetty {
+    enum class GraphicsProtocol { None, Sixel, Kitty };
 
-            #ifdef OS_WINDOWS
-                DWORD numEvents = 0;
-                GetNumberOfConsoleInputEvents(hStdin, &numEvents);
-                if(numEvents == 0) return;
+    // Il protocollo che drawImageGraphics usera' (kitty se c'e', poi sixel)
+    inline GraphicsProtocol graphicsProtocol() {
+        const Capabilities &caps = console().getCapabilities();
+        if (caps.kittyGraphics) return GraphicsProtocol::Kitty;
+        if (caps.sixel) return GraphicsProtocol::Sixel;
+        return GraphicsProtocol::None;
+    }
 
-                INPUT_RECORD irInBuf[128];
-                DWORD numRead = 0;
-                if(!ReadConsoleInput(hStdin, irInBuf, min(numEvents, (DWORD)128), &numRead)) return;
+    // Come drawImage, ma con il protocollo grafico del terminale: l'immagine usa tutti i
+    // pixel delle celle invece di un colore per cella. Va ridisegnata a ogni frame come
+    // il testo; se non cambia non viene ritrasmessa. Le celle sotto diventano spazi e
+    // l'immagine deve restare valida fino a render().
+    // Si usa solo se costa meno delle celle: kitty manda i pixel senza compressione
+    // (4 byte base64 per pixel RGB), quindi un'immagine nuova che pesa piu' di tutte le
+    // sue celle ridisegnate passa al sixel (palette e RLE) e, se anche quello pesa di
+    // piu', a drawImage. Senza protocollo, o su un layer, e' sempre drawImage.
+    inline void drawImageGraphics(const Image &image, int x, int y, int w, int h) {
+        detail::Console &c = console();
+        GraphicsProtocol protocol = graphicsProtocol();
+        if (protocol != GraphicsProtocol::None && !c.activeLayer) {
+            if (image.empty() || w <= 0 || h <= 0) return;
+            if (protocol == GraphicsProtocol::Kitty && detail::placeImageGraphic(image, x, y, w, h, true)) return;
+            if (c.getCapabilities().sixel && detail::placeImageGraphic(image, x, y, w, h, false)) return;
+        }
+        drawImage(image, x, y, w, h);
+    }
 
-                for(DWORD i = 0; i < numRead; i++) {
-                    if(irInBuf[i].EventType == KEY_EVENT) {
-                        KEY_EVENT_RECORD ker = irInBuf[i].Event.KeyEvent;
-                        if(!ker.bKeyDown) continue;
+    inline void drawImageGraphics(const Image &image) {
+        drawImageGraphics(image, 0, 0, terminalWidth(), terminalHeight());
+    }
+}
 
-                        if(ker.uChar.AsciiChar != 0) {
-                            char c = ker.uChar.AsciiChar;
-                            if(c == '\r') keyQueue.push(KEY_ENTER);
-                            else if(c == '\t') keyQueue.push(KEY_TAB);
-                            else if(c == '\b') keyQueue.push(KEY_BACKSPACE);
-                            else if(c == ' ') keyQueue.push(KEY_SPACE);
-                            else if(c >= 32 && c <= 126) keyQueue.push(c);
-                        } else {
-                            switch(ker.wVirtualKeyCode) {
-                                case VK_UP: keyQueue.push(KEY_UP); break;
-                                case VK_DOWN: keyQueue.push(KEY_DOWN); break;
-                                case VK_LEFT: keyQueue.push(KEY_LEFT); break;
-                                case VK_RIGHT: keyQueue.push(KEY_RIGHT); break;
-                                case VK_HOME: keyQueue.push(KEY_HOME); break;
-                                case VK_END: keyQueue.push(KEY_END); break;
-                                case VK_PRIOR: keyQueue.push(KEY_PAGEUP); break;
-                                case VK_NEXT: keyQueue.push(KEY_PAGEDOWN); break;
-                                case VK_INSERT: keyQueue.push(KEY_INSERT); break;
-                                case VK_DELETE: keyQueue.push(KEY_DELETE); break;
-                                case VK_ESCAPE: keyQueue.push(KEY_ESC); break;
-                            }
-                        }
-                    } else if(irInBuf[i].EventType == MOUSE_EVENT) {
-                        MOUSE_EVENT_RECORD mer = irInBuf[i].Event.MouseEvent;
-                        mouseX = mer.dwMousePosition.X;
-                        mouseY = mer.dwMousePosition.Y;
+namespace detail {
+    inline unordered_map<string, unique_ptr<pwetty::Image>> &imageCache() {
+        static unordered_map<string, unique_ptr<pwetty::Image>> cache;
+        return cache;
+    }
+}
 
-                        bool currentButtonState[8] = {false};
-                        currentButtonState[0] = (mer.dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED) != 0;
-                        currentButtonState[1] = (mer.dwButtonState & RIGHTMOST_BUTTON_PRESSED) != 0;
-                        currentButtonState[2] = (mer.dwButtonState & FROM_LEFT_2ND_BUTTON_PRESSED) != 0;
+namespace pwetty {
+    // Registra un'immagine creata dal programma; il riferimento resta valido fino a
+    // unloadImage. Una chiave gia' usata sostituisce l'immagine: i riferimenti a quella
+    // vecchia non valgono piu'.
+    inline const Image &addImage(const string &key, Image image) {
+        auto &slot = detail::imageCache()[key];
+        slot = make_unique<Image>(move(image));
+        return *slot;
+    }
 
-                        for(int b = 0; b < 3; b++) {
-                            if(currentButtonState[b] && !prevMouseButtonState[b]) {
-                                mouseButtonPressed[b] = true;
-                                mouseButtonDown[b] = true;
-                            } else if(!currentButtonState[b] && prevMouseButtonState[b]) {
-                                mouseButtonReleased[b] = true;
-                                mouseButtonDown[b] = false;
-                            } else if(currentButtonState[b]) {
-                                mouseButtonDown[b] = true;
-                            }
-                            prevMouseButtonState[b] = currentButtonState[b];
-                        }
+    inline const Image *findImage(const string &key) {
+        auto &cache = detail::imageCache();
+        auto it = cache.find(key);
+        return it == cache.end() ? nullptr : it->second.get();
+    }
 
-                        if(mer.dwEventFlags & MOUSE_WHEELED) {
-                            int delta = (short)HIWORD(mer.dwButtonState);
-                            int scrollBtn = (delta > 0) ? 3 : 4;
-                            mouseButtonPressed[scrollBtn] = true;
-                            mouseButtonReleased[scrollBtn] = true;
-                        }
+    inline void unloadImage(const string &key) { detail::imageCache().erase(key); }
+    inline void clearImageCache() { detail::imageCache().clear(); }
+
+    #ifdef PWETTY_STB_IMAGE
+        // Decodifica il file la prima volta, poi lo restituisce dalla cache.
+        // Se il file non si legge l'immagine e' vuota (empty()), e resta in cache.
+        inline const Image &loadImage(const string &path) {
+            if (const Image *cached = findImage(path)) return *cached;
+            int w = 0, h = 0;
+            unsigned char *data = stbi_load(path.c_str(), &w, &h, nullptr, 4);
+            if (!data) return addImage(path, Image());
+            Image image(w, h, data);
+            stbi_image_free(data);
+            return addImage(path, move(image));
+        }
+    #endif
+}
+
+#ifdef OS_LINUX
+// ======================== REPLAY ========================
+struct ReplayStats {
+    size_t frames = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+    double bytesPerSecond() const { return seconds > 0 ? bytes / seconds : 0; }
+};
+
+namespace detail {
+    // Legge una stringa JSON che inizia in s[i] (sulle virgolette), i finisce dopo la chiusura
+    inline bool parseJsonString(const string &s, size_t &i, string &out) {
+        out.clear();
+        if (i >= s.size() || s[i] != '"') return false;
+        for (i++; i < s.size(); i++) {
+            char c = s[i];
+            if (c == '"') { i++; return true; }
+            if (c != '\\') { out += c; continue; }
+            if (++i >= s.size()) return false;
+            switch (s[i]) {
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (i + 4 >= s.size()) return false;
+                    char32_t cp = (char32_t)strtoul(s.substr(i + 1, 4).c_str(), nullptr, 16);
+                    i += 4;
+                    // Coppie surrogate
+                    if (cp >= 0xD800 && cp <= 0xDBFF && i + 6 < s.size() && s[i + 1] == '\\' && s[i + 2] == 'u') {
+                        char32_t lo = (char32_t)strtoul(s.substr(i + 3, 4).c_str(), nullptr, 16);
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        i += 6;
                     }
+                    GlyphBytes g = encodeUtf8(cp);
+                    out.append(g.bytes, g.len);
+                    break;
                 }
-            #endif
+                default: out += s[i]; break;
+            }
         }
+        return false;
+    }
+}
 
-        // ======================== INPUT ACCESSORS ========================
-        bool isKeyPressed() const { return !keyQueue.empty(); }
-        int popKey() {
-            if(keyQueue.empty()) return KEY_NONE;
-            int k = keyQueue.front();
-            keyQueue.pop();
-            return k;
+// Rimanda una registrazione asciicast su fd (stdout, una pipe, ...).
+// Con maxSpeed ignora i tempi: serve a misurare il throughput del backend.
+inline ReplayStats replayAsciicast(const string &path, int fd = STDOUT_FILENO, bool maxSpeed = true) {
+    ReplayStats stats;
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file) return stats;
+
+    string line, type, data;
+    char chunk[4096];
+    bool header = true;
+    auto start = chrono::steady_clock::now();
+
+    while (fgets(chunk, sizeof(chunk), file)) {
+        line = chunk;
+        while (!line.empty() && line.back() != '\n' && fgets(chunk, sizeof(chunk), file))
+            line += chunk;
+        if (header) { header = false; continue; }
+
+        size_t i = line.find('[');
+        if (i == string::npos) continue;
+        double t = strtod(line.c_str() + i + 1, nullptr);
+        i = line.find('"', i);
+        if (i == string::npos || !detail::parseJsonString(line, i, type)) continue;
+        i = line.find('"', i);
+        if (i == string::npos || !detail::parseJsonString(line, i, data)) continue;
+        if (type != "o") continue;
+
+        if (!maxSpeed) {
+            auto due = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(t));
+            this_thread::sleep_until(due);
         }
+        detail::writeAll(fd, data.data(), data.size());
+        stats.frames++;
+        stats.bytes += data.size();
+    }
+    fclose(file);
 
-        int getMouseX() const { return (pixelMode?mouseX/2:mouseX); }
-        int getMouseY() const { return mouseY; }
-        bool isMouseButtonDown(int b) const { return b >= 0 && b < 8 ? mouseButtonDown[b] : false; }
-        bool isMouseButtonPressed(int b) const { return b >= 0 && b < 8 ? mouseButtonPressed[b] : false; }
-        bool isMouseButtonReleased(int b) const { return b >= 0 && b < 8 ? mouseButtonReleased[b] : false; }
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
 
-        // ======================== RENDERING ========================
-        void clear(Color bg = DEFAULT_BG) {
-            ensureSize();
-            for (auto &row : buffer)
-                fill(row.begin(), row.end(), ' ');
-            for (auto &row : fgBuffer)
-                fill(row.begin(), row.end(), DEFAULT_FG);
-            for (auto &row : bgBuffer)
-                fill(row.begin(), row.end(), bg);
+// ======================== SHARED VIEWER ========================
+namespace detail {
+    inline volatile sig_atomic_t viewerResized = 0;
+
+    inline void sendViewerLine(int fd, const string &line) {
+        ::send(fd, line.data(), line.size(), MSG_NOSIGNAL);
+    }
+}
+
+// Mostra in questo terminale lo schermo condiviso con startSharing(path) da un altro
+// processo, finche' non si preme 'q' o Ctrl-C o il programma condiviso non si chiude.
+// Non usa il Console. Ritorna false se non riesce a collegarsi.
+inline bool runViewer(const string &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+
+    auto terminalSize = [](int &w, int &h) {
+        struct winsize ws;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+            w = ws.ws_col;
+            h = ws.ws_row;
+        } else {
+            w = 80;
+            h = 24;
         }
+    };
 
-        void resetTerminal() {
-            #ifdef OS_LINUX
-                printf("\033[0m");
-                printf("\033[?25h");
-                printf("\033[2J\033[H"); // Clear screen and move cursor to top
-                fflush(stdout);
-            #else
-                system("cls");
-            #endif
+    int w, h;
+    terminalSize(w, h);
+    Capabilities guess = detail::Console::guessCapabilities();
+    const char *colorterm = getenv("COLORTERM");
+    bool truecolor = colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0);
+    string hello = "pwetty-view 1 " + to_string(w) + " " + to_string(h) + (truecolor ? " truecolor" : " 256");
+    if (guess.rep) hello += " rep";
+    detail::sendViewerLine(fd, hello + "\n");
+
+    struct termios saved;
+    bool tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (tty) {
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_oflag &= ~(OPOST);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    }
+    detail::writeAll(STDOUT_FILENO, "\033[?25l", 6);
+    detail::viewerResized = 0;
+    signal(SIGWINCH, [](int) { detail::viewerResized = 1; });
+
+    char chunk[16384];
+    bool running = true, watchInput = true;
+    while (running) {
+        if (detail::viewerResized) {
+            detail::viewerResized = 0;
+            terminalSize(w, h);
+            detail::sendViewerLine(fd, "size " + to_string(w) + " " + to_string(h) + "\n");
         }
 
-        void render() {
-            ensureSize();
-            
-            #ifdef OS_LINUX
-                // Su Linux usa write diretto per evitare problemi di buffering
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        //if (buffer[y][x] != prevBuffer[y][x] ||
-                        //    fgBuffer[y][x] != prevFgBuffer[y][x] ||
-                        //    bgBuffer[y][x] != prevBgBuffer[y][x]) {
-                        {  
-                            string line = "\033["; 
-                            line += to_string(y + 1) + ";";
-                            line += to_string(x + 1) + "H";
-                            line += rgbFg(fgBuffer[y][x]) + rgbBg(bgBuffer[y][x]);
-                            line += charToUnicode(buffer[y][x]);
-
-                            ::write(STDOUT_FILENO, line.c_str(), line.length());
-                        }
-                    }
-                }
-                
-                ::write(STDOUT_FILENO, RESET_COLOR.c_str(), RESET_COLOR.length());
-                fsync(STDOUT_FILENO);
-            #else
-                string output;
-                
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        if (buffer[y][x] != prevBuffer[y][x] ||
-                            fgBuffer[y][x] != prevFgBuffer[y][x] ||
-                            bgBuffer[y][x] != prevBgBuffer[y][x]) {    
-                            
-                            output += "\033[" + to_string(y + 1) + ";" + to_string(x + 1) + "H";
-                            output += rgbFg(fgBuffer[y][x]) + rgbBg(bgBuffer[y][x]);
-                            output += buffer[y][x];
-                        }
-                    }
-                }
-                
-                output += RESET_COLOR;
-                cout << output << flush;
-            #endif
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (watchInput) FD_SET(STDIN_FILENO, &fds);
+        if (select(fd + 1, &fds, nullptr, nullptr, nullptr) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (FD_ISSET(fd, &fds)) {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            detail::writeAll(STDOUT_FILENO, chunk, n);
+        }
+        if (watchInput && FD_ISSET(STDIN_FILENO, &fds)) {
+            ssize_t n = ::read(STDIN_FILENO, chunk, sizeof(chunk));
+            // Senza input (stdin chiuso o non un terminale) si guarda e basta
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) watchInput = false;
+            for (ssize_t i = 0; i < n; i++)
+                if (chunk[i] == 'q' || chunk[i] == 3) running = false;
+        }
+    }
+
+    signal(SIGWINCH, SIG_DFL);
+    close(fd);
+    if (tty) tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    const char *restore = "\033[0m\033[?25h\033[2J\033[H";
+    detail::writeAll(STDOUT_FILENO, restore, strlen(restore));
+    return true;
+}
+#endif
+
+// ======================== WIDGETS ========================
+// Piccolo livello "retained": i nodi restano in memoria tra un frame e l'altro e
+// vengono ridisegnati nel buffer solo quando sono stati invalidati.
+// Con i widget non bisogna chiamare clearScreen() a ogni frame.
+namespace pwetty {
+    class Widget {
+    public:
+        Widget(int x, int y) : x(x), y(y), dirty(true), visible(true), footprint{0, 0, 0, 0} {}
+        virtual ~Widget() = default;
+
+        void invalidate() { dirty = true; }
+        bool isDirty() const { return dirty; }
+
+        void setPosition(int newX, int newY) {
+            if (newX == x && newY == y) return;
+            x = newX;
+            y = newY;
+            invalidate();
+        }
+
+        void setVisible(bool state) {
+            if (state == visible) return;
+            visible = state;
+            invalidate();
+        }
+
+        int getX() const { return x; }
+        int getY() const { return y; }
+        bool isVisible() const { return visible; }
+
+        // Celle occupate dall'ultimo disegno (coordinate logiche, estremi esclusi)
+        const detail::Rect &getFootprint() const { return footprint; }
+
+        // Rettangolo che il nodo occuperebbe se disegnato ora
+        virtual detail::Rect bounds() const = 0;
+
+        // Aggiornamenti parziali (es. singole celle di una Grid) senza invalidare tutto il nodo
+        virtual bool hasPartialUpdates() const { return false; }
+        virtual void drawPartial() {}
+
+        void erase(const Color &bg) {
+            for (int j = footprint.y1; j < footprint.y2; j++)
+                writeSpan(footprint.x1, footprint.x2 - 1, j, ' ', DEFAULT_FG, bg);
+        }
+
+        void redraw() {
+            if (visible) {
+                draw();
+                footprint = bounds();
+            } else {
+                footprint = {0, 0, 0, 0};
+            }
+            dirty = false;
+        }
+
+    protected:
+        int x, y;
+        bool dirty;
+        bool visible;
+        detail::Rect footprint;
+
+        virtual void draw() = 0;
+    };
+
+    class Label : public Widget {
+    public:
+        Label(int x, int y, const string &text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG)
+            : Widget(x, y), text(text), fg(fg), bg(bg), textW(textWidth(text)) {}
+
+        void setText(const string &newText) {
+            if (newText == text) return;
+            text = newText;
+            textW = textWidth(text);
+            invalidate();
+        }
+
+        void setColors(Color newFg, Color newBg = DEFAULT_BG) {
+            if (newFg == fg && newBg == bg) return;
+            fg = newFg;
+            bg = newBg;
+            invalidate();
+        }
+
+        const string &getText() const { return text; }
+
+        detail::Rect bounds() const override {
+            int w = isInPixelMode() ? (textW + 1) / 2 : textW;
+            return {x, y, x + w, y + 1};
+        }
+
+    protected:
+        string text;
+        Color fg, bg;
+        int textW;
+
+        void draw() override { write(x, y, text, fg, bg); }
+    };
+
+    class Box : public Widget {
+    public:
+        Box(int x1, int y1, int x2, int y2, bool singleLine = false, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG)
+            : Widget(min(x1, x2), min(y1, y2)), w(abs(x2 - x1)), h(abs(y2 - y1)),
+              singleLine(singleLine), fg(fg), bg(bg) {}
 
-            prevBuffer = buffer;
-            prevFgBuffer = fgBuffer;
-            prevBgBuffer = bgBuffer;
+        void setSize(int newW, int newH) {
+            if (newW == w && newH == h) return;
+            w = newW;
+            h = newH;
+            invalidate();
         }
 
-        void write(int x, int y, char c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-            if (pixelMode) x *= 2;
-            if (x >= 0 && x < width && y >= 0 && y < height) {
-                buffer[y][x] = c;
-                fgBuffer[y][x] = (fg == CLEAR) ? getFgColor(x, y) : fg;
-                bgBuffer[y][x] = (bg == CLEAR) ? getBgColor(x, y) : bg;
-                if (pixelMode && x + 1 < width) {
-                    buffer[y][x + 1] = c;
-                    fgBuffer[y][x + 1] = (fg == CLEAR) ? getFgColor(x, y) : fg;
-                    bgBuffer[y][x + 1] = (bg == CLEAR) ? getBgColor(x, y) : bg;
-                }
-            }
+        void setTitle(const string &newTitle) {
+            if (newTitle == title) return;
+            title = newTitle;
+            invalidate();
         }
 
-        void write(int x, int y, string text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-            if (pixelMode) x *= 2;
-            for (size_t i = 0; i < text.size(); i++) {
-                int currentX = x + (pixelMode ? i * 2 : i);
-                if (currentX < width && y >= 0 && y < height) {
-                    buffer[y][currentX] = text[i];
-                    fgBuffer[y][currentX] = (fg == CLEAR) ? getFgColor(currentX, y) : fg;
-                    bgBuffer[y][currentX] = (bg == CLEAR) ? getBgColor(currentX, y) : bg;
-                    if (pixelMode){
-                        currentX += 1;
-                        buffer[y][currentX] = text[i];
-                        fgBuffer[y][currentX] = (fg == CLEAR) ? getFgColor(currentX, y) : fg;
-                        bgBuffer[y][currentX] = (bg == CLEAR) ? getBgColor(currentX, y) : bg;
-                    }
-                }
-            }
+        detail::Rect bounds() const override { return {x, y, x + w + 1, y + h + 1}; }
+
+    protected:
+        int w, h;
+        bool singleLine;
+        Color fg, bg;
+        string title;
+
+        void draw() override {
+            writeBox(x, y, x + w, y + h, singleLine, fg, bg);
+            if (!title.empty())
+                write(x + 2, y, " " + title + " ", fg, bg);
         }
+    };
+
+    // Griglia di celle a spaziatura fissa: set() ridisegna solo la cella toccata
+    class Grid : public Widget {
+    public:
+        struct Cell {
+            char32_t c;
+            Color fg, bg;
+        };
+
+        Grid(int x, int y, int cols, int rows, int spacingX = 1, int spacingY = 1)
+            : Widget(x, y), cols(cols), rows(rows), spacingX(spacingX), spacingY(spacingY),
+              cells(cols * rows, Cell{U' ', DEFAULT_FG, DEFAULT_BG}) {}
 
-        void writeAligned(Alignment align, int y, string text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-            int x = 0;
-            int auxW = pixelMode ? width / 2 : width;
-            if (align == Alignment::Center)
-                x = (auxW - text.size()) / 2;
-            else if (align == Alignment::Right)
-                x = auxW - text.size();
-            write(x, y, text, fg, bg);
+        void set(int col, int row, char32_t c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+            if (col < 0 || col >= cols || row < 0 || row >= rows) return;
+            Cell &cell = cells[row * cols + col];
+            if (cell.c == c && cell.fg == fg && cell.bg == bg) return;
+            cell = Cell{c, fg, bg};
+            if (!dirty) dirtyCells.push_back(row * cols + col);
         }
 
-        void showCursor(bool visible) {
-            if (visible)
-                cout << "\033[?25h";
-            else
-                cout << "\033[?25l";
-            cout.flush();
+        void set(int col, int row, char c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
+            set(col, row, detail::cp437ToCodepoint(c), fg, bg);
         }
 
-        int getWidth() const { return pixelMode ? width / 2 : width; }
-        int getHeight() const { return height; }
-        pair<int, int> getSize() const { return {getWidth(), height}; }
+        const Cell &get(int col, int row) const { return cells[row * cols + col]; }
 
-        Color getFgColor(int x, int y) const {
-            if (x >= 0 && x < width && y >= 0 && y < height)
-                return fgBuffer[y][x];
-            return DEFAULT_FG;
-        }
+        // Posizione sullo schermo della cella (col, row)
+        int cellX(int col) const { return x + col * spacingX; }
+        int cellY(int row) const { return y + row * spacingY; }
 
-        Color getBgColor(int x, int y) const {
-            if (x >= 0 && x < width && y >= 0 && y < height)
-                return bgBuffer[y][x];
-            return DEFAULT_BG;
+        detail::Rect bounds() const override {
+            return {x, y, x + (cols - 1) * spacingX + 1, y + (rows - 1) * spacingY + 1};
         }
 
-        void setPixelMode(bool state) { pixelMode = state; }
-        bool isInPixelMode() const { return pixelMode; }
-    };
-}
+        bool hasPartialUpdates() const override { return !dirtyCells.empty(); }
 
-// ======================== GLOBAL FUNCTIONS ========================
-inline detail::Console& console() { return detail::Console::get(); }
+        void drawPartial() override {
+            for (int i : dirtyCells)
+                drawCell(i);
+            dirtyCells.clear();
+        }
 
-// Display functions
-inline void clearScreen(Color bg = DEFAULT_BG) { console().clear(bg); }
-inline void resetTerminal() { console().resetTerminal(); }
-inline void render() { console().render(); }
+    protected:
+        int cols, rows;
+        int spacingX, spacingY;
+        vector<Cell> cells;
+        vector<int> dirtyCells;
 
-inline void write(int x, int y, char c, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-    console().write(x, y, c, fg, bg);
-}
+        void drawCell(int i) {
+            const Cell &cell = cells[i];
+            write(cellX(i % cols), cellY(i / cols), cell.c, cell.fg, cell.bg);
+        }
 
-inline void write(int x, int y, string text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-    console().write(x, y, text, fg, bg);
-}
+        void draw() override {
+            for (int i = 0; i < cols * rows; i++)
+                drawCell(i);
+            dirtyCells.clear();
+        }
+    };
 
-inline void writeAligned(Alignment align, int y, string text, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-    console().writeAligned(align, y, text, fg, bg);
-}
+    class Ui;
 
-inline void showCursor(bool visible) { console().showCursor(visible); }
+    // Campo di testo; edit() usa advancedInput() e ridisegna solo questo nodo a ogni tasto
+    class TextInput : public Widget {
+    public:
+        TextInput(int x, int y, int width, const string &value = "", Color fg = DEFAULT_FG, Color bg = DEFAULT_BG)
+            : Widget(x, y), width(width), value(value), fg(fg), bg(bg), cursorPos(-1) {}
 
-inline int terminalWidth() { return console().getWidth(); }
-inline int terminalHeight() { return console().getHeight(); }
-inline pair<int, int> terminalSize() { return console().getSize(); }
+        void setValue(const string &newValue) {
+            if (newValue == value) return;
+            value = newValue;
+            invalidate();
+        }
 
-inline Color getFgColor(int x, int y) { return console().getFgColor(x, y); }
-inline Color getBgColor(int x, int y) { return console().getBgColor(x, y); }
+        const string &getValue() const { return value; }
 
-inline void setPixelMode(bool state) { console().setPixelMode(state); }
-inline bool isInPixelMode() { return console().isInPixelMode(); }
+        // Ritorna false se l'utente annulla con ESC (il valore precedente resta)
+        bool edit(Ui &ui);
 
-// Input functions
-inline void updateInput() { console().updateInput(); }
-inline bool keyPressed() { return console().isKeyPressed(); }
-inline int getKey() { return console().popKey(); }
+        detail::Rect bounds() const override { return {x, y, x + width, y + 1}; }
 
-inline int getMouseX() { return console().getMouseX(); }
-inline int getMouseY() { return console().getMouseY(); }
-inline bool isMouseButtonDown(int b = 0) { return console().isMouseButtonDown(b); }
-inline bool isMouseButtonPressed(int b = 0) { return console().isMouseButtonPressed(b); }
-inline bool isMouseButtonReleased(int b = 0) { return console().isMouseButtonReleased(b); }
+    protected:
+        int width;
+        string value;
+        Color fg, bg;
+        int cursorPos; // -1 quando non si sta modificando
 
-inline bool isMouseInArea(int x1, int y1, int x2, int y2) {
-    int mx = getMouseX(), my = getMouseY();
-    return mx >= x1 && mx <= x2 && my >= y1 && my <= y2;
-}
+        void draw() override {
+            // Inizio (in byte) e larghezza in celle di ogni carattere
+            struct Glyph { int offset, cells; };
+            vector<Glyph> glyphs;
+            const char *begin = value.data(), *end = begin + value.size();
+            for (const char *p = begin; p < end;) {
+                int offset = (int)(p - begin);
+                glyphs.push_back({offset, glyphWidth(detail::decodeUtf8(p, end))});
+            }
+            glyphs.push_back({(int)value.size(), 1}); // il cursore dopo l'ultimo carattere
 
-inline bool isMouseAtPosition(int x, int y) {
-    return getMouseX() == x && getMouseY() == y;
-}
+            // Mostra la parte finale del testo se non ci sta, lasciando la cella del cursore
+            int first = (int)glyphs.size() - 1, used = 0;
+            while (first > 0 && used + glyphs[first - 1].cells <= width - 1) used += glyphs[--first].cells;
+            string_view visible(value);
+            visible.remove_prefix(glyphs[first].offset);
+            write(x, y, visible, fg, bg);
+            if (used < width) write(x + used, y, string(width - used, ' '), fg, bg);
 
-// Utility functions
-inline void sleepMs(int ms) {
-    #ifdef OS_WINDOWS
-        if (ms > 0) {
-            Sleep((float)ms/2.f);
-        }
-    #else
-        if (ms > 0) {
-            usleep(ms * 1000); // usleep uses microseconds
+            if (cursorPos >= 0) {
+                int cx = 0, i = first;
+                for (; i + 1 < (int)glyphs.size() && glyphs[i].offset < cursorPos; i++) cx += glyphs[i].cells;
+                if (glyphs[i].offset == cursorPos && cx < width) {
+                    Color cursorFg = bg == DEFAULT_BG ? BLACK : bg, cursorBg = fg == DEFAULT_FG ? WHITE : fg;
+                    if (i + 1 < (int)glyphs.size())
+                        write(x + cx, y, visible.substr(glyphs[i].offset - glyphs[first].offset, glyphs[i + 1].offset - glyphs[i].offset), cursorFg, cursorBg);
+                    else
+                        write(x + cx, y, ' ', cursorFg, cursorBg);
+                }
+            }
         }
-    #endif
-}
+    };
 
-static inline double getTime() {
-    #ifdef OS_WINDOWS
-        static LARGE_INTEGER freq, start;
-        static int init = 0;
-        LARGE_INTEGER now;
-        if (!init) { QueryPerformanceFrequency(&freq); QueryPerformanceCounter(&start); init = 1; }
-        QueryPerformanceCounter(&now);
-        return (now.QuadPart - start.QuadPart) / (double)freq.QuadPart;
-    #else
-        static struct timespec start;
-        static int init = 0;
-        struct timespec now;
-        if (!init) { clock_gettime(CLOCK_MONOTONIC, &start); init = 1; }
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
-    #endif
-}
+    class Ui {
+    public:
+        explicit Ui(Color background = DEFAULT_BG)
+            : background(background), lastW(-1), lastH(-1) {}
 
-inline string *advancedInput(string initialValue, function<void(string &, int &, Key)> onChange = nullptr)
-{
-    string buffer = initialValue;
-    int cursorPos = initialValue.size();
-    Key latestKey;
+        template <class T, class... Args>
+        T &add(Args &&...args) {
+            nodes.push_back(make_unique<T>(forward<Args>(args)...));
+            return static_cast<T &>(*nodes.back());
+        }
 
-    if (onChange)
-    {
-        onChange(buffer, cursorPos, (Key)-1);
-    }
+        void remove(Widget &widget) {
+            for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+                if (it->get() == &widget) {
+                    widget.erase(background);
+                    invalidateOverlapping(widget.getFootprint(), &widget);
+                    nodes.erase(it);
+                    return;
+                }
+            }
+        }
 
-    while (true)
-    {
-        updateInput();
-        if (!keyPressed())
-        {
-            sleepMs(16); // 60 fps
-            continue;
+        void invalidateAll() {
+            for (auto &node : nodes)
+                node->invalidate();
         }
 
-        int key = getKey();
-        latestKey = (Key)key;
+        // Ridisegna nel buffer solo i nodi invalidati. Non chiama render().
+        void update() {
+            auto [w, h] = terminalSize();
+            if (w != lastW || h != lastH) {
+                clearScreen(background);
+                invalidateAll();
+                lastW = w;
+                lastH = h;
+            }
 
-        switch (key)
-        {
-        case KEY_ENTER:
-            return new string(buffer);
-        case KEY_BACKSPACE:
-            if (cursorPos > 0)
-            {
-                buffer.erase(cursorPos - 1, 1);
-                cursorPos--;
+            // Prima cancella le vecchie impronte dei nodi sporchi...
+            vector<detail::Rect> erased;
+            for (auto &node : nodes) {
+                if (node->isDirty()) {
+                    node->erase(background);
+                    erased.push_back(node->getFootprint());
+                }
             }
-            break;
-        case KEY_ESC:
-            return nullptr;
-        case KEY_LEFT:
-            if (cursorPos > 0)
-                cursorPos--;
-            break;
-        case KEY_RIGHT:
-            if (cursorPos < buffer.size())
-                cursorPos++;
-            break;
-        case KEY_DELETE:
-            if (cursorPos < buffer.size())
-                buffer.erase(cursorPos, 1);
-            break;
-        default:
-            if (key >= 32 && key <= 126)
-            {
-                buffer.insert(buffer.begin() + cursorPos, key);
-                cursorPos++;
+            // ...poi i nodi puliti che si sovrapponevano vanno ridisegnati anche loro
+            for (const detail::Rect &r : erased)
+                invalidateOverlapping(r, nullptr);
+
+            for (auto &node : nodes) {
+                if (node->isDirty())
+                    node->redraw();
+                else if (node->hasPartialUpdates())
+                    node->drawPartial();
             }
-            break;
         }
 
-        if (onChange)
-        {
-            onChange(buffer, cursorPos, latestKey);
+    private:
+        vector<unique_ptr<Widget>> nodes;
+        Color background;
+        int lastW, lastH;
+
+        void invalidateOverlapping(const detail::Rect &r, const Widget *except) {
+            if (r.empty()) return;
+            for (auto &node : nodes) {
+                const detail::Rect &f = node->getFootprint();
+                if (node.get() != except && !f.empty() &&
+                    f.x1 < r.x2 && r.x1 < f.x2 && f.y1 < r.y2 && r.y1 < f.y2)
+                    node->invalidate();
+            }
         }
+    };
+
+    inline bool TextInput::edit(Ui &ui) {
+        // value mostra il testo mentre lo si scrive: con ESC si torna all'originale
+        string original = value;
+        string *result = advancedInput(value, [&](string &text, int &cursor, Key) {
+            value = text;
+            cursorPos = cursor;
+            invalidate();
+            ui.update();
+            render();
+        });
+
+        bool confirmed = result != nullptr;
+        cursorPos = -1;
+        value = confirmed ? *result : original;
+        delete result;
+        invalidate();
+        ui.update();
+        return confirmed;
     }
 }
 
-// ==== Drawing functions ====
-
-// @deprecated (use pixelMode instead)
-inline void writePixel(int x, int y, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c1 = (char)219, char c2 = (char)219) {
-    bool pixelMode = isInPixelMode();
-    setPixelMode(false);
-    write(x * 2, y, c1, fg, bg);
-    write(x * 2 + 1, y, c2, fg, bg);
-    setPixelMode(pixelMode);
+// ======================== APP ========================
+// Il ciclo che ogni programma riscrive (input, update, disegno, render, sleep) fatto una
+// volta sola: update a passo fisso, disegno solo quando serve e, quando non c'e' niente
+// da fare, il processo resta fermo in attesa dell'input invece di girare a vuoto.
+namespace detail {
+    inline volatile sig_atomic_t appResized = 0;
 }
 
-inline void writeRectangle(int x1, int y1, int x2, int y2, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-    if (x1 > x2) swap(x1, x2);
-    if (y1 > y2) swap(y1, y2);
+namespace pwetty {
+    enum class EventType { KeyPress, KeyRelease, MouseDown, MouseUp, MouseMove, Resize };
 
-    for (int i = x1; i <= x2; ++i) {
-        for (int j = y1; j <= y2; ++j) {
-            write(i, j, c, fg, bg);
-        }
-    }
-}
+    struct Event {
+        EventType type;
+        int key = KEY_NONE;   // KeyPress: come getKey(); KeyRelease: il tasto rilasciato
+        int x = 0, y = 0;     // mouse, oppure le nuove dimensioni per Resize
+        int button = 0;
+    };
 
-inline void writeBox(int x1, int y1, int x2, int y2, bool singleLine = false, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-    if (x1 > x2) swap(x1, x2);
-    if (y1 > y2) swap(y1, y2);
+    class App {
+    public:
+        virtual ~App() = default;
 
-    for (int i = x1 + 1; i < x2; ++i) {
-        write(i, y1, (char)(singleLine ? 196 : 205), fg, bg);
-        write(i, y2, (char)(singleLine ? 196 : 205), fg, bg);
-    }
-    for (int i = y1 + 1; i < y2; ++i) {
-        write(x1, i, (char)(singleLine ? 179 : 186), fg, bg);
-        write(x2, i, (char)(singleLine ? 179 : 186), fg, bg);
-    }
+        // Un evento ridisegna sempre; onUpdate gira solo mentre l'app e' animata
+        virtual void onEvent(const Event &) {}
+        virtual void onUpdate(double) {}
+        virtual void onDraw() {}
 
-    write(x1, y1, (char)(singleLine ? 218 : 201), fg, bg); // top-left
-    write(x1, y2, (char)(singleLine ? 192 : 200), fg, bg); // bottom-left
-    write(x2, y1, (char)(singleLine ? 191 : 187), fg, bg); // top-right
-    write(x2, y2, (char)(singleLine ? 217 : 188), fg, bg); // bottom-right
-}
+        void run() {
+            running = true;
+            dirty = true;
+            console().getCurrentSize(lastW, lastH);
+            lastMouseX = getMouseX();
+            lastMouseY = getMouseY();
+            accumulator = 0;
+            double last = getTime();
 
-inline void writeLine(int x1, int y1, int x2, int y2, char c = (char)219, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG) {
-    int dx = abs(x2 - x1);
-    int dy = abs(y2 - y1);
-    int sx = (x1 < x2) ? 1 : -1;
-    int sy = (y1 < y2) ? 1 : -1;
-    int err = dx - dy;
+            #ifdef OS_LINUX
+                detail::appResized = 0;
+                auto previousHandler = signal(SIGWINCH, [](int) { detail::appResized = 1; });
+            #endif
 
-    while (true) {
-        write(x1, y1, c, fg, bg);
-        if (x1 == x2 && y1 == y2)
-            break;
-        int e2 = 2 * err;
-        if (e2 > -dy) {
-            err -= dy;
-            x1 += sx;
+            while (running) {
+                pollEvents();
+
+                // Passo fisso: se un frame ha tardato si recuperano i passi persi, ma al
+                // massimo maxCatchUp secondi (dopo una pausa lunga non si rincorre il tempo)
+                double now = getTime();
+                if (animating) {
+                    accumulator += min(now - last, maxCatchUp);
+                    while (running && accumulator >= step) {
+                        onUpdate(step);
+                        accumulator -= step;
+                        dirty = true;
+                    }
+                } else {
+                    accumulator = 0;
+                }
+                last = now;
+                if (!running) break;
+
+                if (dirty) {
+                    dirty = false;
+                    if (clearOnDraw) clearScreen(background);
+                    onDraw();
+                    render();
+                }
+                waitForWork(animating ? step - accumulator : -1);
+            }
+
+            #ifdef OS_LINUX
+                signal(SIGWINCH, previousHandler);
+            #endif
         }
-        if (e2 < dx) {
-            err += dx;
-            y1 += sy;
+
+        void quit() { running = false; }
+        void invalidate() { dirty = true; }
+
+        // Con l'animazione attiva onUpdate gira updateRate volte al secondo e ogni passo
+        // ridisegna; senza, l'app si sveglia solo per input e resize
+        void setAnimating(bool state) { animating = state; }
+        bool isAnimating() const { return animating; }
+        void setUpdateRate(double hz) { step = 1.0 / max(hz, 0.001); }
+        void setClearOnDraw(bool state, Color bg = DEFAULT_BG) { clearOnDraw = state; background = bg; }
+
+    private:
+        bool running = false;
+        bool dirty = true;
+        bool animating = false;
+        bool clearOnDraw = true;
+        Color background = DEFAULT_BG;
+        double step = 1.0 / 60;
+        double accumulator = 0;
+        double maxCatchUp = 0.25;
+        int lastW = 0, lastH = 0;
+        int lastMouseX = 0, lastMouseY = 0;
+
+        void emit(const Event &e) {
+            dirty = true;
+            onEvent(e);
+            // Ctrl-C arriva come tasto (ISIG e' spento): se l'app non lo gestisce si esce
+            if (e.type == EventType::KeyPress && e.key == 3) quit();
         }
-    }
-}
 
-inline void writeCircleOutline(int x, int y, int r, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) {
-    for (int i = x - r - 1; i <= x + r + 1; i++) {
-        for (int j = y - r - 1; j <= y + r + 1; j++) {
-            if (distanceInt(i, j, x, y) == r) {
-                writePixel(i, j, fg, bg, c, c);
+        void pollEvents() {
+            updateInput();
+
+            int w, h;
+            console().getCurrentSize(w, h);
+            if (w != lastW || h != lastH) {
+                lastW = w;
+                lastH = h;
+                emit({EventType::Resize, KEY_NONE, w, h});
             }
-        }
-    }
-}
 
-inline void writeCircleFilled(int x, int y, float r, Color fg = DEFAULT_FG, Color bg = DEFAULT_BG, char c = (char)219) {
-    for (int i = x - r - 1; i <= x + r + 1; i++) {
-        for (int j = y - r - 1; j <= y + r + 1; j++) {
-            if (distanceInt(i, j, x, y) <= r) {
-                writePixel(i, j, fg, bg, c, c);
+            while (running && keyPressed())
+                emit({EventType::KeyPress, getKey()});
+            if (keyEventsEnabled()) {
+                // Le maiuscole condividono lo stato delle minuscole: un solo evento
+                for (int key = 0; key < 128; key++)
+                    if (!(key >= 'A' && key <= 'Z') && isKeyJustReleased(key)) emit({EventType::KeyRelease, key});
+                for (int key = KEY_UP; key <= KEY_DELETE; key++)
+                    if (isKeyJustReleased(key)) emit({EventType::KeyRelease, key});
+            }
+
+            int mx = getMouseX(), my = getMouseY();
+            if (mx != lastMouseX || my != lastMouseY) {
+                lastMouseX = mx;
+                lastMouseY = my;
+                emit({EventType::MouseMove, KEY_NONE, mx, my});
+            }
+            for (int b = 0; b < 8; b++) {
+                if (isMouseButtonPressed(b)) emit({EventType::MouseDown, KEY_NONE, mx, my, b});
+                if (isMouseButtonReleased(b)) emit({EventType::MouseUp, KEY_NONE, mx, my, b});
             }
         }
-    }
-}
 
-inline Color randColor() {
-    return Color(randomInt(0, 255), randomInt(0, 255), randomInt(0, 255));
+        // Aspetta input, un resize o il prossimo passo (timeout < 0: solo input)
+        void waitForWork(double timeout) {
+            if (!running || dirty) return;
+            #ifdef OS_LINUX
+                // I viewer collegati si accettano e servono in render(): non si dorme troppo
+                bool sharing = console().isSharing();
+                if (sharing) timeout = timeout < 0 ? 0.1 : min(timeout, 0.1);
+
+                // SIGWINCH bloccato fino a pselect: un resize arrivato tra il controllo e
+                // l'attesa la interrompe comunque invece di perdersi
+                sigset_t winch, original;
+                sigemptyset(&winch);
+                sigaddset(&winch, SIGWINCH);
+                sigprocmask(SIG_BLOCK, &winch, &original);
+                if (detail::appResized) {
+                    detail::appResized = 0;
+                    sigprocmask(SIG_SETMASK, &original, nullptr);
+                    return;
+                }
+
+                fd_set readFds, writeFds;
+                FD_ZERO(&readFds);
+                FD_ZERO(&writeFds);
+                FD_SET(STDIN_FILENO, &readFds);
+                int maxFd = STDIN_FILENO;
+                // Output non bloccante rimasto indietro: svegliarsi quando il terminale lo prende
+                int outFd = console().getOutputFd();
+                if (outputStats().bytesPending > 0) {
+                    FD_SET(outFd, &writeFds);
+                    maxFd = max(maxFd, outFd);
+                }
+
+                struct timespec ts;
+                struct timespec *tsp = nullptr;
+                if (timeout >= 0) {
+                    long long ns = (long long)(timeout * 1e9);
+                    ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+                    tsp = &ts;
+                }
+                // EINTR (SIGWINCH) va bene: il resize si legge al giro dopo
+                int ready = pselect(maxFd + 1, &readFds, &writeFds, nullptr, tsp, &original);
+                sigprocmask(SIG_SETMASK, &original, nullptr);
+                detail::appResized = 0;
+                if (ready > 0 && FD_ISSET(outFd, &writeFds))
+                    flushOutput();
+                if (sharing) render();
+            #else
+                // La console segnala input, mouse e resize sullo stesso handle
+                DWORD ms = timeout < 0 ? INFINITE : (DWORD)(timeout * 1000);
+                WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), ms);
+            #endif
+        }
+    };
 }
 
-#ifdef OS_LINUX
 // https://symbl.cc/en/2563/ NON rimuovere MAI il commento.
 string charToUnicode(char c){
     string str;
@@ -1309,6 +6446,5 @@ string charToUnicode(char c){
     }
     return str;
 }
-#endif
 
 #endif // PWETTY_H
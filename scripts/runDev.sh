@@ -1,6 +1,13 @@
 #!/bin/bash
 set -e  # interrompe lo script se qualsiasi comando fallisce
 
+# --trace: compila con le zone di pwetty e salva la traccia per chrome://tracing
+trace=0
+if [ "$1" = "--trace" ]; then
+    trace=1
+    shift
+fi
+
 file="$1"
 shift
 exe="${file%.cpp}"
@@ -14,10 +21,19 @@ NC="\033[0m"  # reset colore
 # Controllo argomento
 if [ -z "$file" ]; then
     echo -e "${RED}Errore: specifica un file .cpp da compilare.${NC}"
-    echo "Uso: ./run_profile.sh programma.cpp [argomenti]"
+    echo "Uso: ./run_profile.sh [--trace] programma.cpp [argomenti]"
     exit 1
 fi
 
+if [ "$trace" = 1 ]; then
+    echo -e "${YELLOW}Compilazione di $file con PWETTY_PROFILE...${NC}"
+    g++ -std=c++17 -O2 -pthread -DPWETTY_PROFILE "$file" -o "$exe"
+    PWETTY_TRACE="$exe.trace.json" "./$exe" "$@"
+    rm -f "./$exe"
+    echo -e "${GREEN}Traccia salvata in $exe.trace.json (apri con ui.perfetto.dev)${NC}"
+    exit 0
+fi
+
 # Compilazione con gprof e AddressSanitizer
 echo -e "${YELLOW}Compilazione di $file...${NC}"
 g++ -pg -fsanitize=address "$file" -o "$exe"